@@ -58,6 +58,8 @@ static void copyAV1PicParam(NVContext *ctx, NVBuffer* buffer, CUVIDPICPARAMS *pi
 
     pps->frame_type = buf->pic_info_fields.bits.frame_type;
     pps->show_frame = buf->pic_info_fields.bits.show_frame;
+    //hidden frames can still be shown later with show_existing_frame, in which case they're resolved on demand
+    ctx->pictureHidden = !buf->pic_info_fields.bits.show_frame;
     pps->disable_cdf_update = buf->pic_info_fields.bits.disable_cdf_update;
     pps->allow_screen_content_tools = buf->pic_info_fields.bits.allow_screen_content_tools;
     pps->force_integer_mv = buf->pic_info_fields.bits.force_integer_mv || picParams->intra_pic_flag;
@@ -304,20 +306,22 @@ static void copyAV1SliceParam(NVContext *ctx, NVBuffer* buf, CUVIDPICPARAMS *pic
 }
 
 static void copyAV1SliceData(NVContext *ctx, NVBuffer* buf, CUVIDPICPARAMS *picParams) {
-    uint32_t offset = (uint32_t) ctx->bitstreamBuffer.size;
     for (int i = 0; i < ctx->lastSliceParamsCount; i++) {
         VASliceParameterBufferAV1 *sliceParams = &((VASliceParameterBufferAV1*) ctx->lastSliceParams)[i];
 
-        //copy just the slice we're looking at
-        appendBuffer(&ctx->bitstreamBuffer, PTROFF(buf->ptr, sliceParams->slice_data_offset), sliceParams->slice_data_size);
+        //append just the slice we're looking at
+        uint32_t offset = appendSliceData(ctx, buf, sliceParams->slice_data_offset, sliceParams->slice_data_size, NULL, 0);
 
-        //now append the offset and size of the slice we just copied
-        appendBuffer(&ctx->sliceOffsets, &offset, sizeof(offset));
+        //now append the offset and size of the slice we just appended
+        if (!appendBuffer(&ctx->sliceOffsets, &offset, sizeof(offset))) {
+            ctx->bitstreamFailed = true;
+        }
         offset += sliceParams->slice_data_size;
-        appendBuffer(&ctx->sliceOffsets, &offset, sizeof(offset));
+        if (!appendBuffer(&ctx->sliceOffsets, &offset, sizeof(offset))) {
+            ctx->bitstreamFailed = true;
+        }
+        picParams->nBitstreamDataLen += sliceParams->slice_data_size;
     }
-
-    picParams->nBitstreamDataLen = ctx->bitstreamBuffer.size;
 }
 
 static cudaVideoCodec computeAV1CudaCodec(VAProfile profile) {
@@ -344,4 +348,5 @@ const DECLARE_CODEC(av1Codec) = {
     },
     .supportedProfileCount = ARRAY_SIZE(av1SupportedProfiles),
     .supportedProfiles = av1SupportedProfiles,
+    .sliceDataInArena = true,
 };
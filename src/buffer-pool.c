@@ -0,0 +1,97 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <malloc.h>
+
+#include "buffer-pool.h"
+
+void init_buffer_pool(BufferPool *pool, size_t maxCachedBytes) {
+    pthread_mutex_init(&pool->mutex, NULL);
+    for (int i = 0; i < BUFFER_POOL_CLASSES; i++) {
+        pool->freeList[i] = NULL;
+    }
+    pool->cachedBytes = 0;
+    pool->maxCachedBytes = maxCachedBytes;
+    pool->hits = 0;
+    pool->misses = 0;
+    pool->oversize = 0;
+}
+
+//returns the size class for the allocation, or -1 if it's too large to pool
+static int size_class(size_t size) {
+    if (size <= (1u << BUFFER_POOL_MIN_CLASS_BITS)) {
+        return 0;
+    }
+    if (size > (1u << BUFFER_POOL_MAX_CLASS_BITS)) {
+        return -1;
+    }
+    //number of bits needed to hold size-1, so exact powers of two land in their own class
+    int bits = (int) (sizeof(unsigned long) * 8) - __builtin_clzl((unsigned long) (size - 1));
+    return bits - BUFFER_POOL_MIN_CLASS_BITS;
+}
+
+static size_t class_size(int cls) {
+    return ((size_t) 1) << (cls + BUFFER_POOL_MIN_CLASS_BITS);
+}
+
+void *buffer_pool_alloc(BufferPool *pool, size_t size) {
+    int cls = size_class(size);
+    if (cls < 0) {
+        pthread_mutex_lock(&pool->mutex);
+        pool->oversize++;
+        pthread_mutex_unlock(&pool->mutex);
+        return memalign(BUFFER_POOL_ALIGNMENT, size);
+    }
+
+    pthread_mutex_lock(&pool->mutex);
+    void *ptr = pool->freeList[cls];
+    if (ptr != NULL) {
+        pool->freeList[cls] = *(void**) ptr;
+        pool->cachedBytes -= class_size(cls);
+        pool->hits++;
+        pthread_mutex_unlock(&pool->mutex);
+        return ptr;
+    }
+    pool->misses++;
+    pthread_mutex_unlock(&pool->mutex);
+
+    return memalign(BUFFER_POOL_ALIGNMENT, class_size(cls));
+}
+
+void buffer_pool_free(BufferPool *pool, void *ptr, size_t size) {
+    if (ptr == NULL) {
+        return;
+    }
+
+    int cls = size_class(size);
+    if (cls < 0) {
+        free(ptr);
+        return;
+    }
+
+    pthread_mutex_lock(&pool->mutex);
+    if (pool->cachedBytes + class_size(cls) > pool->maxCachedBytes) {
+        pthread_mutex_unlock(&pool->mutex);
+        free(ptr);
+        return;
+    }
+    *(void**) ptr = pool->freeList[cls];
+    pool->freeList[cls] = ptr;
+    pool->cachedBytes += class_size(cls);
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+void free_buffer_pool(BufferPool *pool) {
+    pthread_mutex_lock(&pool->mutex);
+    for (int i = 0; i < BUFFER_POOL_CLASSES; i++) {
+        void *ptr = pool->freeList[i];
+        while (ptr != NULL) {
+            void *next = *(void**) ptr;
+            free(ptr);
+            ptr = next;
+        }
+        pool->freeList[i] = NULL;
+    }
+    pool->cachedBytes = 0;
+    pthread_mutex_unlock(&pool->mutex);
+    pthread_mutex_destroy(&pool->mutex);
+}
@@ -0,0 +1,36 @@
+#ifndef BUFFER_POOL_H
+#define BUFFER_POOL_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+
+//A pool of power-of-two sized host buffers. Freed buffers are kept on a per size class free list and
+//handed back out to the next allocation in the same class, up to a cap on the total number of bytes held.
+//Allocations larger than the biggest class go straight to the heap.
+#define BUFFER_POOL_MIN_CLASS_BITS  6
+#define BUFFER_POOL_MAX_CLASS_BITS  24
+#define BUFFER_POOL_CLASSES         (BUFFER_POOL_MAX_CLASS_BITS - BUFFER_POOL_MIN_CLASS_BITS + 1)
+#define BUFFER_POOL_ALIGNMENT       64
+
+typedef struct {
+    pthread_mutex_t mutex;
+    void            *freeList[BUFFER_POOL_CLASSES];
+    //bytes currently held on the free lists
+    size_t          cachedBytes;
+    size_t          maxCachedBytes;
+    uint64_t        hits;
+    uint64_t        misses;
+    uint64_t        oversize;
+} BufferPool;
+
+void init_buffer_pool(BufferPool *pool, size_t maxCachedBytes);
+
+void *buffer_pool_alloc(BufferPool *pool, size_t size);
+
+//size must be the same as the size passed to buffer_pool_alloc
+void buffer_pool_free(BufferPool *pool, void *ptr, size_t size);
+
+void free_buffer_pool(BufferPool *pool);
+
+#endif // BUFFER_POOL_H
@@ -0,0 +1,219 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+
+#include "caps-cache.h"
+
+//bump this whenever the layout of CapsTable changes
+#define CAPS_CACHE_MAGIC    0x4e564443
+#define CAPS_CACHE_VERSION  2
+
+typedef struct {
+    uint32_t    magic;
+    uint32_t    version;
+    uint32_t    size;
+} CapsCacheHeader;
+
+CodecCaps *caps_table_entry(CapsTable *table, int codec, int chromaFormat, int bitDepth) {
+    int depthIdx = (bitDepth - 8) / 2;
+    if (codec < 0 || codec >= CAPS_MAX_CODECS || chromaFormat < 0 || chromaFormat >= CAPS_MAX_CHROMA_FORMATS
+            || bitDepth < 8 || (bitDepth & 1) != 0 || depthIdx >= CAPS_MAX_BIT_DEPTHS) {
+        return NULL;
+    }
+    return &table->entries[codec][chromaFormat][depthIdx];
+}
+
+bool caps_cache_make_key(char *key, size_t size, const uint8_t uuid[CAPS_UUID_SIZE], const char *suffix) {
+    FILE *f = fopen("/sys/module/nvidia/version", "r");
+    if (f == NULL) {
+        return false;
+    }
+    char version[32];
+    bool ret = fgets(version, sizeof(version), f) != NULL;
+    fclose(f);
+    version[strcspn(version, "\n")] = '\0';
+    //it ends up in a file name
+    if (!ret || version[0] == '\0' || strchr(version, '/') != NULL) {
+        return false;
+    }
+
+    size_t len = 0;
+    for (int i = 0; i < CAPS_UUID_SIZE && len < size; i++) {
+        len += snprintf(key + len, size - len, "%02x", uuid[i]);
+    }
+    if (len >= size) {
+        return false;
+    }
+    int n = snprintf(key + len, size - len, "-%s%s", version, suffix);
+    return n > 0 && (size_t) n < size - len;
+}
+
+//the driver lists each GPU under /proc/driver/nvidia/gpus/<bus id>, with a line like "GPU UUID: GPU-xxxxxxxx-xxxx-..."
+static bool uuid_from_bus_id(const char *busId, uint8_t uuid[CAPS_UUID_SIZE]) {
+    char path[512];
+    snprintf(path, sizeof(path), "/proc/driver/nvidia/gpus/%s/information", busId);
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        return false;
+    }
+
+    char line[256];
+    bool ret = false;
+    while (!ret && fgets(line, sizeof(line), f) != NULL) {
+        char *value = strstr(line, "GPU-");
+        if (strncmp(line, "GPU UUID:", 9) != 0 || value == NULL) {
+            continue;
+        }
+        int nibbles = 0;
+        for (char *c = value + 4; *c != '\0' && *c != '\n' && nibbles < CAPS_UUID_SIZE * 2; c++) {
+            int v;
+            if (*c == '-') {
+                continue;
+            } else if (*c >= '0' && *c <= '9') {
+                v = *c - '0';
+            } else if (*c >= 'a' && *c <= 'f') {
+                v = *c - 'a' + 10;
+            } else if (*c >= 'A' && *c <= 'F') {
+                v = *c - 'A' + 10;
+            } else {
+                break;
+            }
+            uuid[nibbles / 2] = (nibbles & 1) ? (uuid[nibbles / 2] | v) : (v << 4);
+            nibbles++;
+        }
+        ret = nibbles == CAPS_UUID_SIZE * 2;
+    }
+    fclose(f);
+    return ret;
+}
+
+bool caps_cache_uuid_from_drm_fd(int fd, uint8_t uuid[CAPS_UUID_SIZE]) {
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || !S_ISCHR(st.st_mode)) {
+        return false;
+    }
+
+    //the device link points at the PCI device, whose name is the bus id
+    char path[128], target[512];
+    snprintf(path, sizeof(path), "/sys/dev/char/%u:%u/device", major(st.st_rdev), minor(st.st_rdev));
+    ssize_t len = readlink(path, target, sizeof(target) - 1);
+    if (len <= 0) {
+        return false;
+    }
+    target[len] = '\0';
+    const char *busId = strrchr(target, '/');
+    return uuid_from_bus_id(busId != NULL ? busId + 1 : target, uuid);
+}
+
+bool caps_cache_uuid_of_only_gpu(uint8_t uuid[CAPS_UUID_SIZE]) {
+    DIR *dir = opendir("/proc/driver/nvidia/gpus");
+    if (dir == NULL) {
+        return false;
+    }
+
+    char busId[256] = {0};
+    int count = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] != '.') {
+            snprintf(busId, sizeof(busId), "%s", entry->d_name);
+            count++;
+        }
+    }
+    closedir(dir);
+
+    return count == 1 && uuid_from_bus_id(busId, uuid);
+}
+
+static bool cache_dir(char *path, size_t size) {
+    const char *xdgCache = getenv("XDG_CACHE_HOME");
+    const char *home = getenv("HOME");
+    int len;
+    if (xdgCache != NULL && xdgCache[0] == '/') {
+        len = snprintf(path, size, "%s/nvidia-vaapi-driver", xdgCache);
+    } else if (home != NULL && home[0] == '/') {
+        len = snprintf(path, size, "%s/.cache/nvidia-vaapi-driver", home);
+    } else {
+        return false;
+    }
+    return len > 0 && (size_t) len < size;
+}
+
+static bool cache_path(char *path, size_t size, const char *key) {
+    char dir[4096];
+    if (!cache_dir(dir, sizeof(dir))) {
+        return false;
+    }
+    int len = snprintf(path, size, "%s/caps-%s.bin", dir, key);
+    return len > 0 && (size_t) len < size;
+}
+
+bool caps_cache_load(CapsTable *table, const char *key) {
+    char path[4096];
+    if (!cache_path(path, sizeof(path), key)) {
+        return false;
+    }
+
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) {
+        return false;
+    }
+
+    CapsCacheHeader header;
+    CapsTable loaded;
+    bool ret = fread(&header, sizeof(header), 1, f) == 1
+            && header.magic == CAPS_CACHE_MAGIC && header.version == CAPS_CACHE_VERSION && header.size == sizeof(CapsTable)
+            && fread(&loaded, sizeof(loaded), 1, f) == 1;
+    fclose(f);
+
+    if (ret) {
+        *table = loaded;
+    }
+    return ret;
+}
+
+bool caps_cache_save(const CapsTable *table, const char *key) {
+    char dir[4096], path[4096], tmpPath[4096 + 32];
+    if (!cache_dir(dir, sizeof(dir)) || !cache_path(path, sizeof(path), key)) {
+        return false;
+    }
+
+    //the parent is normally there already, and if it isn't we only create the last level
+    if (mkdir(dir, 0755) != 0 && access(dir, W_OK) != 0) {
+        return false;
+    }
+
+    //write to a temporary file and rename it over the old one, so a concurrent load never sees half a table
+    //the name has to be unique, as several driver instances in the same process can save at once
+    snprintf(tmpPath, sizeof(tmpPath), "%s.XXXXXX", path);
+    int fd = mkstemp(tmpPath);
+    if (fd == -1) {
+        return false;
+    }
+    FILE *f = fdopen(fd, "wb");
+    if (f == NULL) {
+        close(fd);
+        unlink(tmpPath);
+        return false;
+    }
+
+    CapsCacheHeader header = {
+        .magic = CAPS_CACHE_MAGIC,
+        .version = CAPS_CACHE_VERSION,
+        .size = sizeof(CapsTable),
+    };
+    bool ret = fwrite(&header, sizeof(header), 1, f) == 1 && fwrite(table, sizeof(CapsTable), 1, f) == 1;
+    ret = fclose(f) == 0 && ret;
+
+    if (!ret || rename(tmpPath, path) != 0) {
+        unlink(tmpPath);
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,56 @@
+#ifndef CAPS_CACHE_H
+#define CAPS_CACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+//A table of what the decoder supports for each codec, chroma format and bit depth, filled in as combinations are
+//queried. It can be saved to (and loaded from) a file under $XDG_CACHE_HOME, keyed by the GPU and driver version,
+//so later processes don't need to ask NVDEC at all.
+
+//large enough for every cudaVideoCodec up to AV1, and the monochrome, 420, 422 and 444 chroma formats
+#define CAPS_MAX_CODECS         16
+#define CAPS_MAX_CHROMA_FORMATS 4
+//8, 10 and 12 bit
+#define CAPS_MAX_BIT_DEPTHS     3
+
+typedef struct {
+    uint8_t     probed;
+    uint8_t     supported;
+    uint16_t    minWidth;
+    uint16_t    minHeight;
+    uint32_t    maxWidth;
+    uint32_t    maxHeight;
+    uint32_t    maxMBCount;
+} CodecCaps;
+
+typedef struct {
+    CodecCaps   entries[CAPS_MAX_CODECS][CAPS_MAX_CHROMA_FORMATS][CAPS_MAX_BIT_DEPTHS];
+    //which surface formats the exporter can handle, this depends on the backend as well as the GPU
+    uint8_t     surfaceFormatsProbed;
+    uint8_t     supports16BitSurface;
+    uint8_t     supports444Surface;
+} CapsTable;
+
+#define CAPS_UUID_SIZE 16
+
+//returns NULL if the combination can't be stored in the table
+CodecCaps *caps_table_entry(CapsTable *table, int codec, int chromaFormat, int bitDepth);
+
+//builds the key for a GPU from its UUID and the kernel driver version, the suffix is appended as is,
+//returns false if the driver version isn't available
+bool caps_cache_make_key(char *key, size_t size, const uint8_t uuid[CAPS_UUID_SIZE], const char *suffix);
+
+//these find a GPU's UUID through procfs, without initialising CUDA or waking the GPU
+bool caps_cache_uuid_from_drm_fd(int fd, uint8_t uuid[CAPS_UUID_SIZE]);
+
+//only succeeds if there's exactly one NVIDIA GPU in the system
+bool caps_cache_uuid_of_only_gpu(uint8_t uuid[CAPS_UUID_SIZE]);
+
+//returns false if there's no cache file for the key, or it's from an incompatible version of the driver
+bool caps_cache_load(CapsTable *table, const char *key);
+
+bool caps_cache_save(const CapsTable *table, const char *key);
+
+#endif // CAPS_CACHE_H
@@ -0,0 +1,38 @@
+#include <stdlib.h>
+#include <dlfcn.h>
+
+#include "cuda-extra.h"
+
+#define LOAD_SYMBOL(f, name) f->name = dlsym(f->lib, #name)
+
+int cuda_extra_load_functions(CudaExtraFunctions **functions) {
+    CudaExtraFunctions *f = calloc(1, sizeof(CudaExtraFunctions));
+    if (f == NULL) {
+        return -1;
+    }
+
+    //this will just take another reference to the library ffnvcodec has already loaded
+    f->lib = dlopen("libcuda.so.1", RTLD_LAZY | RTLD_LOCAL);
+    if (f->lib == NULL) {
+        free(f);
+        return -1;
+    }
+
+    LOAD_SYMBOL(f, cuMemHostAlloc);
+    LOAD_SYMBOL(f, cuMemFreeHost);
+    LOAD_SYMBOL(f, cuStreamCreateWithPriority);
+    LOAD_SYMBOL(f, cuCtxGetStreamPriorityRange);
+    LOAD_SYMBOL(f, cuCtxGetCurrent);
+    LOAD_SYMBOL(f, cuCtxSetCurrent);
+
+    *functions = f;
+    return 0;
+}
+
+void cuda_extra_free_functions(CudaExtraFunctions **functions) {
+    if (*functions != NULL) {
+        dlclose((*functions)->lib);
+        free(*functions);
+        *functions = NULL;
+    }
+}
@@ -0,0 +1,27 @@
+#ifndef CUDA_EXTRA_H
+#define CUDA_EXTRA_H
+
+#include <ffnvcodec/dynlink_loader.h>
+
+//CUDA driver functions that ffnvcodec's CudaFunctions doesn't load for us.
+//Any of these may be NULL if the installed driver doesn't export them, so callers need to check.
+
+#ifndef CU_MEMHOSTALLOC_PORTABLE
+#define CU_MEMHOSTALLOC_PORTABLE        0x01
+#endif
+
+typedef struct {
+    void *lib;
+    CUresult (CUDAAPI *cuMemHostAlloc)(void **pp, size_t bytesize, unsigned int flags);
+    CUresult (CUDAAPI *cuMemFreeHost)(void *p);
+    CUresult (CUDAAPI *cuStreamCreateWithPriority)(CUstream *phStream, unsigned int flags, int priority);
+    CUresult (CUDAAPI *cuCtxGetStreamPriorityRange)(int *leastPriority, int *greatestPriority);
+    CUresult (CUDAAPI *cuCtxGetCurrent)(CUcontext *pctx);
+    CUresult (CUDAAPI *cuCtxSetCurrent)(CUcontext ctx);
+} CudaExtraFunctions;
+
+int cuda_extra_load_functions(CudaExtraFunctions **functions);
+
+void cuda_extra_free_functions(CudaExtraFunctions **functions);
+
+#endif // CUDA_EXTRA_H
@@ -22,7 +22,7 @@
 void findGPUIndexFromFd(NVDriver *drv) {
     //find the CUDA device id
     char drmUuid[16];
-    get_device_uuid(&drv->driverContext, drmUuid);
+    get_device_uuid(&drv->gpu->driverContext, drmUuid);
 
     int gpuCount = 0;
     if (CHECK_CUDA_RESULT(drv->cu->cuDeviceGetCount(&gpuCount))) {
@@ -43,6 +43,8 @@ void findGPUIndexFromFd(NVDriver *drv) {
     drv->cudaGpuId = 0;
 }
 
+extern const NVBackend DIRECT_BACKEND;
+
 static void debug(EGLenum error,const char *command,EGLint messageType,EGLLabelKHR threadLabel,EGLLabelKHR objectLabel,const char* message) {
     LOG("[EGL] %s: %s", command, message);
 }
@@ -97,19 +99,63 @@ bool direct_initExporter(NVDriver *drv) {
         drv->drmFd = dup(drv->drmFd);
     }
 
-    bool ret = init_nvdriver(&drv->driverContext, drv->drmFd);
+    //every instance on the same GPU can share the one RM client, so key on the render node
+    struct stat buf;
+    if (fstat(drv->drmFd, &buf) != 0) {
+        close(drv->drmFd);
+        drv->drmFd = -1;
+        return false;
+    }
+
+    NVGpu *gpu = lockSharedGpu(&DIRECT_BACKEND, (minor(buf.st_rdev) & 0x7f) + 1);
+    if (gpu == NULL) {
+        close(drv->drmFd);
+        drv->drmFd = -1;
+        return false;
+    }
 
-    //TODO this isn't really correct as we don't know if the driver version actually supports importing them
-    //but we don't have an easy way to find out.
-    drv->supports16BitSurface = true;
-    drv->supports444Surface = true;
-    findGPUIndexFromFd(drv);
+    drv->gpu = gpu;
+    if (gpu->refs == 0) {
+        if (!init_nvdriver(&gpu->driverContext, drv->drmFd)) {
+            drv->gpu = NULL;
+            unlockSharedGpu(gpu, false);
+            close(drv->drmFd);
+            drv->drmFd = -1;
+            return false;
+        }
+
+        //TODO this isn't really correct as we don't know if the driver version actually supports importing them
+        //but we don't have an easy way to find out.
+        gpu->supports16BitSurface = true;
+        gpu->supports444Surface = true;
+        findGPUIndexFromFd(drv);
+        gpu->cudaGpuId = drv->cudaGpuId;
+    } else {
+        //the shared context already has its own fd for this GPU
+        close(drv->drmFd);
+        drv->drmFd = gpu->driverContext.drmFd;
+        drv->cudaGpuId = gpu->cudaGpuId;
+    }
 
-    return ret;
+    drv->supports16BitSurface = gpu->supports16BitSurface;
+    drv->supports444Surface = gpu->supports444Surface;
+    unlockSharedGpu(gpu, true);
+
+    return true;
 }
 
 void direct_releaseExporter(NVDriver *drv) {
-    free_nvdriver(&drv->driverContext);
+    NVGpu *gpu = drv->gpu;
+    if (gpu == NULL) {
+        return;
+    }
+    drv->gpu = NULL;
+
+    //only the last instance on this GPU frees the RM client
+    if (releaseSharedGpu(gpu)) {
+        free_nvdriver(&gpu->driverContext);
+        freeSharedGpu(gpu);
+    }
 }
 
 static bool import_to_cuda(NVDriver *drv, NVDriverImage *image, int bpc, int channels, NVCudaImage *cudaImage, CUarray *array) {
@@ -202,7 +248,7 @@ BackingImage *direct_allocateBackingImage(NVDriver *drv, const NVSurface *surfac
 
     LOG("Allocating BackingImages: %p %dx%d", backingImage, surface->width, surface->height);
     for (uint32_t i = 0; i < fmtInfo->numPlanes; i++) {
-        alloc_image(&drv->driverContext, surface->width >> p[i].ss.x, surface->height >> p[i].ss.y,
+        alloc_image(&drv->gpu->driverContext, surface->width >> p[i].ss.x, surface->height >> p[i].ss.y,
             p[i].channelCount, 8 * fmtInfo->bppc, p[i].fourcc, &driverImages[i]);
     }
 
@@ -294,7 +340,7 @@ void direct_destroyAllBackingImage(NVDriver *drv) {
     pthread_mutex_unlock(&drv->imagesMutex);
 }
 
-static bool copyFrameToSurface(NVDriver *drv, CUdeviceptr ptr, NVSurface *surface, uint32_t pitch) {
+static bool copyFrameToSurface(NVDriver *drv, CUdeviceptr ptr, NVSurface *surface, uint32_t pitch, CUstream stream) {
     BackingImage *img = surface->backingImage;
     const NVFormatInfo *fmtInfo = &formatsInfo[img->format];
     uint32_t y = 0;
@@ -311,20 +357,10 @@ static bool copyFrameToSurface(NVDriver *drv, CUdeviceptr ptr, NVSurface *surfac
             .Height = surface->height >> p->ss.y,
             .WidthInBytes = (surface->width >> p->ss.x) * fmtInfo->bppc * p->channelCount
         };
-        if (i == fmtInfo->numPlanes - 1) {
-            CHECK_CUDA_RESULT(drv->cu->cuMemcpy2D(&cpy));
-        } else {
-            CHECK_CUDA_RESULT(drv->cu->cuMemcpy2DAsync(&cpy, 0));
-        }
+        CHECK_CUDA_RESULT_RETURN(drv->cu->cuMemcpy2DAsync(&cpy, stream), false);
         y += surface->height >> p->ss.y;
     }
 
-    //notify anyone waiting for us to be resolved
-    pthread_mutex_lock(&surface->mutex);
-    surface->resolving = 0;
-    pthread_cond_signal(&surface->cond);
-    pthread_mutex_unlock(&surface->mutex);
-
     return true;
 }
 
@@ -348,12 +384,12 @@ bool direct_realiseSurface(NVDriver *drv, NVSurface *surface) {
     return true;
 }
 
-bool direct_exportCudaPtr(NVDriver *drv, CUdeviceptr ptr, NVSurface *surface, uint32_t pitch) {
+bool direct_exportCudaPtr(NVDriver *drv, CUdeviceptr ptr, NVSurface *surface, uint32_t pitch, CUstream stream) {
     if (!direct_realiseSurface(drv, surface)) {
         return false;
     }
 
-    if (ptr != 0 && !copyFrameToSurface(drv, ptr, surface, pitch)) {
+    if (ptr != 0 && !copyFrameToSurface(drv, ptr, surface, pitch, stream)) {
         LOG("Unable to update surface from frame");
         return false;
     } else if (ptr == 0) {
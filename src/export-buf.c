@@ -57,21 +57,35 @@ static PFNEGLCREATESTREAMKHRPROC eglCreateStreamKHR;
 static PFNEGLDESTROYSTREAMKHRPROC eglDestroyStreamKHR;
 static PFNEGLSTREAMIMAGECONSUMERCONNECTNVPROC eglStreamImageConsumerConnectNV;
 
+extern const NVBackend EGL_BACKEND;
+
 static void debug(EGLenum error,const char *command,EGLint messageType,EGLLabelKHR threadLabel,EGLLabelKHR objectLabel,const char* message) {
     LOG("[EGL] %s: %s", command, message);
 }
 
 void egl_releaseExporter(NVDriver *drv) {
+    NVGpu *gpu = drv->gpu;
+    if (gpu == NULL) {
+        return;
+    }
+    drv->gpu = NULL;
+
+    //the stream is shared with other instances on this GPU, only the last one tears it down
+    if (!releaseSharedGpu(gpu)) {
+        LOG("Exporter still in use by other instances");
+        return;
+    }
+
     //TODO not sure if this is still needed as we don't return anything now
-    LOG("Releasing exporter, %d outstanding frames", drv->numFramesPresented);
+    LOG("Releasing exporter, %d outstanding frames", gpu->numFramesPresented);
     while (true) {
       CUeglFrame eglframe;
-      CUresult cuStatus = drv->cu->cuEGLStreamProducerReturnFrame(&drv->cuStreamConnection, &eglframe, NULL);
+      CUresult cuStatus = drv->cu->cuEGLStreamProducerReturnFrame(&gpu->cuStreamConnection, &eglframe, NULL);
       if (cuStatus == CUDA_SUCCESS) {
-        drv->numFramesPresented--;
+        gpu->numFramesPresented--;
         for (int i = 0; i < 3; i++) {
             if (eglframe.frame.pArray[i] != NULL) {
-                LOG("Cleaning up CUDA array %p (%d outstanding)", eglframe.frame.pArray[i], drv->numFramesPresented);
+                LOG("Cleaning up CUDA array %p (%d outstanding)", eglframe.frame.pArray[i], gpu->numFramesPresented);
                 drv->cu->cuArrayDestroy(eglframe.frame.pArray[i]);
                 eglframe.frame.pArray[i] = NULL;
             }
@@ -82,42 +96,44 @@ void egl_releaseExporter(NVDriver *drv) {
     }
     LOG("Done releasing frames");
 
-    if (drv->cuStreamConnection != NULL) {
-        drv->cu->cuEGLStreamProducerDisconnect(&drv->cuStreamConnection);
+    if (gpu->cuStreamConnection != NULL) {
+        drv->cu->cuEGLStreamProducerDisconnect(&gpu->cuStreamConnection);
     }
 
-    if (drv->eglDisplay != EGL_NO_DISPLAY) {
-        if (drv->eglStream != EGL_NO_STREAM_KHR) {
-            eglDestroyStreamKHR(drv->eglDisplay, drv->eglStream);
-            drv->eglStream = EGL_NO_STREAM_KHR;
+    if (gpu->eglDisplay != EGL_NO_DISPLAY) {
+        if (gpu->eglStream != EGL_NO_STREAM_KHR) {
+            eglDestroyStreamKHR(gpu->eglDisplay, gpu->eglStream);
+            gpu->eglStream = EGL_NO_STREAM_KHR;
         }
         //TODO terminate the EGLDisplay here?, sounds like that could break stuff
-        drv->eglDisplay = EGL_NO_DISPLAY;
+        gpu->eglDisplay = EGL_NO_DISPLAY;
     }
+
+    freeSharedGpu(gpu);
 }
 
 static bool reconnect(NVDriver *drv) {
     LOG("Reconnecting to stream");
-    eglInitialize(drv->eglDisplay, NULL, NULL);
-    if (drv->cuStreamConnection != NULL) {
-        CHECK_CUDA_RESULT_RETURN(drv->cu->cuEGLStreamProducerDisconnect(&drv->cuStreamConnection), false);
+    eglInitialize(drv->gpu->eglDisplay, NULL, NULL);
+    if (drv->gpu->cuStreamConnection != NULL) {
+        CHECK_CUDA_RESULT_RETURN(drv->cu->cuEGLStreamProducerDisconnect(&drv->gpu->cuStreamConnection), false);
     }
-    if (drv->eglStream != EGL_NO_STREAM_KHR) {
-        eglDestroyStreamKHR(drv->eglDisplay, drv->eglStream);
+    if (drv->gpu->eglStream != EGL_NO_STREAM_KHR) {
+        eglDestroyStreamKHR(drv->gpu->eglDisplay, drv->gpu->eglStream);
     }
-    drv->numFramesPresented = 0;
+    drv->gpu->numFramesPresented = 0;
     //tell the driver we don't want it to reuse any EGLImages
     EGLint stream_attrib_list[] = { EGL_SUPPORT_REUSE_NV, EGL_FALSE, EGL_NONE };
-    drv->eglStream = eglCreateStreamKHR(drv->eglDisplay, stream_attrib_list);
-    if (drv->eglStream == EGL_NO_STREAM_KHR) {
+    drv->gpu->eglStream = eglCreateStreamKHR(drv->gpu->eglDisplay, stream_attrib_list);
+    if (drv->gpu->eglStream == EGL_NO_STREAM_KHR) {
         LOG("Unable to create EGLStream");
         return false;
     }
-    if (!eglStreamImageConsumerConnectNV(drv->eglDisplay, drv->eglStream, 0, 0, NULL)) {
+    if (!eglStreamImageConsumerConnectNV(drv->gpu->eglDisplay, drv->gpu->eglStream, 0, 0, NULL)) {
         LOG("Unable to connect EGLImage stream consumer");
         return false;
     }
-    CHECK_CUDA_RESULT_RETURN(drv->cu->cuEGLStreamProducerConnect(&drv->cuStreamConnection, drv->eglStream, 0, 0), false);
+    CHECK_CUDA_RESULT_RETURN(drv->cu->cuEGLStreamProducerConnect(&drv->gpu->cuStreamConnection, drv->gpu->eglStream, 0, 0), false);
     return true;
 }
 
@@ -247,18 +263,31 @@ bool egl_initExporter(NVDriver *drv) {
     PFNEGLQUERYDMABUFFORMATSEXTPROC eglQueryDmaBufFormatsEXT = (PFNEGLQUERYDMABUFFORMATSEXTPROC) eglGetProcAddress("eglQueryDmaBufFormatsEXT");
     PFNEGLDEBUGMESSAGECONTROLKHRPROC eglDebugMessageControlKHR = (PFNEGLDEBUGMESSAGECONTROLKHRPROC) eglGetProcAddress("eglDebugMessageControlKHR");
 
-    drv->eglDisplay = eglGetPlatformDisplay(EGL_PLATFORM_DEVICE_EXT, (EGLDeviceEXT) drv->eglDevice, NULL);
-    if (drv->eglDisplay == NULL) {
+    //the EGLDevice is the same for every instance on this GPU, so if another instance has already
+    //set up the display and stream we can just use those
+    NVGpu *gpu = lockSharedGpu(&EGL_BACKEND, (uintptr_t) drv->eglDevice);
+    if (gpu == NULL) {
+        return false;
+    }
+    if (gpu->refs > 0) {
+        goto done;
+    }
+    gpu->cudaGpuId = drv->cudaGpuId;
+
+    gpu->eglDisplay = eglGetPlatformDisplay(EGL_PLATFORM_DEVICE_EXT, (EGLDeviceEXT) drv->eglDevice, NULL);
+    if (gpu->eglDisplay == NULL) {
         LOG("Falling back to using default EGLDisplay");
-        drv->eglDisplay = eglGetDisplay(NULL);
+        gpu->eglDisplay = eglGetDisplay(NULL);
     }
 
-    if (drv->eglDisplay == NULL) {
+    if (gpu->eglDisplay == NULL) {
+        unlockSharedGpu(gpu, false);
         return false;
     }
 
-    if (!eglInitialize(drv->eglDisplay, NULL, NULL)) {
-        LOG("Unable to initialise EGL for display: %p", drv->eglDisplay);
+    if (!eglInitialize(gpu->eglDisplay, NULL, NULL)) {
+        LOG("Unable to initialise EGL for display: %p", gpu->eglDisplay);
+        unlockSharedGpu(gpu, false);
         return false;
     }
     //setup debug logging
@@ -267,7 +296,7 @@ bool egl_initExporter(NVDriver *drv) {
     //see if the driver supports 16-bit exports
     EGLint formats[64];
     EGLint formatCount;
-    if (eglQueryDmaBufFormatsEXT(drv->eglDisplay, 64, formats, &formatCount)) {
+    if (eglQueryDmaBufFormatsEXT(gpu->eglDisplay, 64, formats, &formatCount)) {
         bool r16 = false, rg1616 = false;
         for (int i = 0; i < formatCount; i++) {
             const char *fourcc = (const char *)&formats[i];
@@ -278,27 +307,33 @@ bool egl_initExporter(NVDriver *drv) {
                 rg1616 = true;
             }
         }
-        drv->supports16BitSurface = r16 & rg1616;
-        drv->supports444Surface = false;
-        if (drv->supports16BitSurface) {
+        gpu->supports16BitSurface = r16 & rg1616;
+        gpu->supports444Surface = false;
+        if (gpu->supports16BitSurface) {
             LOG("Driver supports 16-bit surfaces");
         } else {
             LOG("Driver doesn't support 16-bit surfaces");
         }
     }
 
+done:
+    drv->gpu = gpu;
+    drv->supports16BitSurface = gpu->supports16BitSurface;
+    drv->supports444Surface = gpu->supports444Surface;
+    unlockSharedGpu(gpu, true);
+
     return true;
 }
 
 static bool exportBackingImage(NVDriver *drv, BackingImage *img) {
     int planes = 0;
-    if (!eglExportDMABUFImageQueryMESA(drv->eglDisplay, img->image, &img->fourcc, &planes, img->mods)) {
+    if (!eglExportDMABUFImageQueryMESA(drv->gpu->eglDisplay, img->image, &img->fourcc, &planes, img->mods)) {
         LOG("eglExportDMABUFImageQueryMESA failed");
         return false;
     }
 
     LOG("eglExportDMABUFImageQueryMESA: %p %.4s (%x) planes:%d mods:%lx %lx", img, (char*)&img->fourcc, img->fourcc, planes, img->mods[0], img->mods[1]);
-    EGLBoolean r = eglExportDMABUFImageMESA(drv->eglDisplay, img->image, img->fds, img->strides, img->offsets);
+    EGLBoolean r = eglExportDMABUFImageMESA(drv->gpu->eglDisplay, img->image, img->fds, img->strides, img->offsets);
     //LOG("Offset/Pitch: %d %d %d %d", surface->offsets[0], surface->offsets[1], surface->strides[0], surface->strides[1]);
 
     if (!r) {
@@ -338,9 +373,9 @@ bool egl_destroyBackingImage(NVDriver *drv, BackingImage *img) {
             close(img->fds[i]);
         }
     }
-    //eglStreamReleaseImageNV(drv->eglDisplay, drv->eglStream, surface->eglImage, EGL_NO_SYNC);
+    //eglStreamReleaseImageNV(drv->gpu->eglDisplay, drv->gpu->eglStream, surface->eglImage, EGL_NO_SYNC);
     //destroy them rather than releasing them
-    eglDestroyImage(drv->eglDisplay, img->image);
+    eglDestroyImage(drv->gpu->eglDisplay, img->image);
     CHECK_CUDA_RESULT_RETURN(drv->cu->cuArrayDestroy(img->arrays[0]), false);
     CHECK_CUDA_RESULT_RETURN(drv->cu->cuArrayDestroy(img->arrays[1]), false);
     img->arrays[0] = NULL;
@@ -459,16 +494,21 @@ BackingImage *egl_allocateBackingImage(NVDriver *drv, const NVSurface *surface)
     CHECK_CUDA_RESULT_RETURN(drv->cu->cuArray3DCreate(&eglframe.frame.pArray[0], &arrDesc), NULL);
     CHECK_CUDA_RESULT_RETURN(drv->cu->cuArray3DCreate(&eglframe.frame.pArray[1], &arr2Desc), NULL);
 
-    pthread_mutex_lock(&drv->exportMutex);
+    //the stream may be shared with other instances on this GPU, so hold the lock until we've taken our frame back out
+    pthread_mutex_lock(&drv->gpu->exportMutex);
 
     LOG("Presenting frame %d %dx%d (%p, %p, %p)", surface->pictureIdx, eglframe.width, eglframe.height, surface, eglframe.frame.pArray[0], eglframe.frame.pArray[1]);
-    if (CHECK_CUDA_RESULT(drv->cu->cuEGLStreamProducerPresentFrame( &drv->cuStreamConnection, eglframe, NULL))) {
+    if (CHECK_CUDA_RESULT(drv->cu->cuEGLStreamProducerPresentFrame( &drv->gpu->cuStreamConnection, eglframe, NULL))) {
         //if we got an error here, try to reconnect to the EGLStream
         if (!reconnect(drv)) {
+            pthread_mutex_unlock(&drv->gpu->exportMutex);
             return NULL;
         }
         //and try again
-        CHECK_CUDA_RESULT_RETURN(drv->cu->cuEGLStreamProducerPresentFrame( &drv->cuStreamConnection, eglframe, NULL), NULL);
+        if (CHECK_CUDA_RESULT(drv->cu->cuEGLStreamProducerPresentFrame( &drv->gpu->cuStreamConnection, eglframe, NULL))) {
+            pthread_mutex_unlock(&drv->gpu->exportMutex);
+            return NULL;
+        }
     }
 
     BackingImage *ret = NULL;
@@ -476,20 +516,20 @@ BackingImage *egl_allocateBackingImage(NVDriver *drv, const NVSurface *surface)
         EGLenum event = 0;
         EGLAttrib aux = 0;
         //check for the next event
-        if (eglQueryStreamConsumerEventNV(drv->eglDisplay, drv->eglStream, 0, &event, &aux) != EGL_TRUE) {
+        if (eglQueryStreamConsumerEventNV(drv->gpu->eglDisplay, drv->gpu->eglStream, 0, &event, &aux) != EGL_TRUE) {
             break;
         }
 
         if (event == EGL_STREAM_IMAGE_ADD_NV) {
-            EGLImage image = eglCreateImage(drv->eglDisplay, EGL_NO_CONTEXT, EGL_STREAM_CONSUMER_IMAGE_NV, drv->eglStream, NULL);
+            EGLImage image = eglCreateImage(drv->gpu->eglDisplay, EGL_NO_CONTEXT, EGL_STREAM_CONSUMER_IMAGE_NV, drv->gpu->eglStream, NULL);
             LOG("Adding frame from EGLStream: %p", image);
         } else if (event == EGL_STREAM_IMAGE_REMOVE_NV) {
             //Not sure if this is ever called
-            eglDestroyImage(drv->eglDisplay, (EGLImage) aux);
+            eglDestroyImage(drv->gpu->eglDisplay, (EGLImage) aux);
             LOG("Removing frame from EGLStream: %p", aux);
         } else if (event == EGL_STREAM_IMAGE_AVAILABLE_NV) {
             EGLImage img;
-            if (!eglStreamAcquireImageNV(drv->eglDisplay, drv->eglStream, &img, EGL_NO_SYNC_NV)) {
+            if (!eglStreamAcquireImageNV(drv->gpu->eglDisplay, drv->gpu->eglStream, &img, EGL_NO_SYNC_NV)) {
                 LOG("eglStreamAcquireImageNV failed");
                 break;
             }
@@ -501,11 +541,11 @@ BackingImage *egl_allocateBackingImage(NVDriver *drv, const NVSurface *surface)
         }
     }
 
-    pthread_mutex_unlock(&drv->exportMutex);
+    pthread_mutex_unlock(&drv->gpu->exportMutex);
     return ret;
 }
 
-static bool copyFrameToSurface(NVDriver *drv, CUdeviceptr ptr, NVSurface *surface, uint32_t pitch) {
+static bool copyFrameToSurface(NVDriver *drv, CUdeviceptr ptr, NVSurface *surface, uint32_t pitch, CUstream stream) {
     int bpp = surface->format == cudaVideoSurfaceFormat_NV12 ? 1 : 2;
     CUDA_MEMCPY2D cpy = {
         .srcMemoryType = CU_MEMORYTYPE_DEVICE,
@@ -516,7 +556,7 @@ static bool copyFrameToSurface(NVDriver *drv, CUdeviceptr ptr, NVSurface *surfac
         .Height = surface->height,
         .WidthInBytes = surface->width * bpp
     };
-    CHECK_CUDA_RESULT_RETURN(drv->cu->cuMemcpy2DAsync(&cpy, 0), false);
+    CHECK_CUDA_RESULT_RETURN(drv->cu->cuMemcpy2DAsync(&cpy, stream), false);
     CUDA_MEMCPY2D cpy2 = {
         .srcMemoryType = CU_MEMORYTYPE_DEVICE,
         .srcDevice = ptr,
@@ -527,13 +567,7 @@ static bool copyFrameToSurface(NVDriver *drv, CUdeviceptr ptr, NVSurface *surfac
         .Height = surface->height >> 1,
         .WidthInBytes = surface->width * bpp
     };
-    CHECK_CUDA_RESULT_RETURN(drv->cu->cuMemcpy2D(&cpy2), false);
-
-    //notify anyone waiting for us to be resolved
-    pthread_mutex_lock(&surface->mutex);
-    surface->resolving = 0;
-    pthread_cond_signal(&surface->cond);
-    pthread_mutex_unlock(&surface->mutex);
+    CHECK_CUDA_RESULT_RETURN(drv->cu->cuMemcpy2DAsync(&cpy2, stream), false);
 
     return true;
 }
@@ -585,12 +619,12 @@ bool egl_realiseSurface(NVDriver *drv, NVSurface *surface) {
     return true;
 }
 
-bool egl_exportCudaPtr(NVDriver *drv, CUdeviceptr ptr, NVSurface *surface, uint32_t pitch) {
+bool egl_exportCudaPtr(NVDriver *drv, CUdeviceptr ptr, NVSurface *surface, uint32_t pitch, CUstream stream) {
     if (!egl_realiseSurface(drv, surface)) {
         return false;
     }
 
-    if (ptr != 0 && !copyFrameToSurface(drv, ptr, surface, pitch)) {
+    if (ptr != 0 && !copyFrameToSurface(drv, ptr, surface, pitch, stream)) {
         LOG("Unable to update surface from frame");
         return false;
     } else if (ptr == 0) {
@@ -0,0 +1,237 @@
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "fast-copy.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define FAST_COPY_X86
+#endif
+
+//below this a plain memcpy is faster, and the destination is likely to still be in cache when it's read
+#define FAST_COPY_NT_THRESHOLD          (256 * 1024)
+//above this the copy is split between the calling thread and the workers
+#define FAST_COPY_PARALLEL_THRESHOLD    (4 * 1024 * 1024)
+#define FAST_COPY_MAX_WORKERS           3
+
+typedef void (*CopyFunc)(void *dst, const void *src, size_t size);
+
+static void copy_scalar(void *dst, const void *src, size_t size) {
+    memcpy(dst, src, size);
+}
+
+static CopyFunc copyFunc = copy_scalar;
+static pthread_once_t initOnce = PTHREAD_ONCE_INIT;
+//the workers are started by the first parallel copy, and stopped by release_fast_copy
+static _Atomic(bool) workersStarted;
+
+static struct {
+    //held for the duration of a parallel copy, only one can run at a time
+    pthread_mutex_t busy;
+    pthread_mutex_t mutex;
+    pthread_cond_t  start;
+    pthread_cond_t  done;
+    pthread_t       threads[FAST_COPY_MAX_WORKERS];
+    int             workerCount;
+    uint32_t        generation;
+    int             pending;
+    bool            exiting;
+    uint8_t         *dst;
+    const uint8_t   *src;
+    size_t          size;
+    size_t          chunk;
+} pool = {
+    .busy = PTHREAD_MUTEX_INITIALIZER,
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .start = PTHREAD_COND_INITIALIZER,
+    .done = PTHREAD_COND_INITIALIZER,
+};
+
+#ifdef FAST_COPY_X86
+__attribute__((target("sse2")))
+static void copy_nt_sse2(void *dst, const void *src, size_t size) {
+    uint8_t *d = dst;
+    const uint8_t *s = src;
+
+    //streaming stores need an aligned destination
+    size_t head = (16 - ((uintptr_t) d & 15)) & 15;
+    head = head > size ? size : head;
+    memcpy(d, s, head);
+    d += head;
+    s += head;
+    size -= head;
+
+    for (; size >= 64; size -= 64, d += 64, s += 64) {
+        __m128i a = _mm_loadu_si128((const __m128i*) (s + 0));
+        __m128i b = _mm_loadu_si128((const __m128i*) (s + 16));
+        __m128i c = _mm_loadu_si128((const __m128i*) (s + 32));
+        __m128i e = _mm_loadu_si128((const __m128i*) (s + 48));
+        _mm_stream_si128((__m128i*) (d + 0), a);
+        _mm_stream_si128((__m128i*) (d + 16), b);
+        _mm_stream_si128((__m128i*) (d + 32), c);
+        _mm_stream_si128((__m128i*) (d + 48), e);
+    }
+    _mm_sfence();
+
+    memcpy(d, s, size);
+}
+
+__attribute__((target("avx2")))
+static void copy_nt_avx2(void *dst, const void *src, size_t size) {
+    uint8_t *d = dst;
+    const uint8_t *s = src;
+
+    size_t head = (32 - ((uintptr_t) d & 31)) & 31;
+    head = head > size ? size : head;
+    memcpy(d, s, head);
+    d += head;
+    s += head;
+    size -= head;
+
+    for (; size >= 128; size -= 128, d += 128, s += 128) {
+        __m256i a = _mm256_loadu_si256((const __m256i*) (s + 0));
+        __m256i b = _mm256_loadu_si256((const __m256i*) (s + 32));
+        __m256i c = _mm256_loadu_si256((const __m256i*) (s + 64));
+        __m256i e = _mm256_loadu_si256((const __m256i*) (s + 96));
+        _mm256_stream_si256((__m256i*) (d + 0), a);
+        _mm256_stream_si256((__m256i*) (d + 32), b);
+        _mm256_stream_si256((__m256i*) (d + 64), c);
+        _mm256_stream_si256((__m256i*) (d + 96), e);
+    }
+    _mm_sfence();
+
+    memcpy(d, s, size);
+}
+#endif
+
+static void *copy_worker(void *param) {
+    int idx = (int) (intptr_t) param;
+    uint32_t seen = 0;
+
+    pthread_mutex_lock(&pool.mutex);
+    while (true) {
+        while (!pool.exiting && pool.generation == seen) {
+            pthread_cond_wait(&pool.start, &pool.mutex);
+        }
+        if (pool.exiting) {
+            break;
+        }
+        seen = pool.generation;
+
+        //chunk 0 is done by the calling thread
+        size_t offset = pool.chunk * (idx + 1);
+        size_t size = offset >= pool.size ? 0 : pool.size - offset;
+        size = size > pool.chunk ? pool.chunk : size;
+        uint8_t *dst = pool.dst + offset;
+        const uint8_t *src = pool.src + offset;
+        pthread_mutex_unlock(&pool.mutex);
+
+        copyFunc(dst, src, size);
+
+        pthread_mutex_lock(&pool.mutex);
+        if (--pool.pending == 0) {
+            pthread_cond_signal(&pool.done);
+        }
+    }
+    pthread_mutex_unlock(&pool.mutex);
+
+    return NULL;
+}
+
+static void init_fast_copy(void) {
+#ifdef FAST_COPY_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        copyFunc = copy_nt_avx2;
+    } else if (__builtin_cpu_supports("sse2")) {
+        copyFunc = copy_nt_sse2;
+    }
+#endif
+}
+
+static void start_workers(void) {
+    pthread_mutex_lock(&pool.mutex);
+    if (!atomic_load(&workersStarted)) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        int wanted = cpus > 1 ? (int) (cpus - 1) : 0;
+        wanted = wanted > FAST_COPY_MAX_WORKERS ? FAST_COPY_MAX_WORKERS : wanted;
+        for (int i = 0; i < wanted; i++) {
+            if (pthread_create(&pool.threads[i], NULL, copy_worker, (void*) (intptr_t) i) != 0) {
+                break;
+            }
+            pool.workerCount++;
+        }
+        atomic_store(&workersStarted, true);
+    }
+    pthread_mutex_unlock(&pool.mutex);
+}
+
+void release_fast_copy(void) {
+    //wait for any parallel copy that's still running
+    pthread_mutex_lock(&pool.busy);
+    pthread_mutex_lock(&pool.mutex);
+    pool.exiting = true;
+    pthread_cond_broadcast(&pool.start);
+    int count = pool.workerCount;
+    pthread_mutex_unlock(&pool.mutex);
+
+    for (int i = 0; i < count; i++) {
+        pthread_join(pool.threads[i], NULL);
+    }
+
+    //workers that are started again begin from generation 0
+    pthread_mutex_lock(&pool.mutex);
+    pool.workerCount = 0;
+    pool.generation = 0;
+    pool.exiting = false;
+    atomic_store(&workersStarted, false);
+    pthread_mutex_unlock(&pool.mutex);
+    pthread_mutex_unlock(&pool.busy);
+}
+
+void fast_copy(void *dst, const void *src, size_t size) {
+    if (size < FAST_COPY_NT_THRESHOLD) {
+        memcpy(dst, src, size);
+        return;
+    }
+
+    pthread_once(&initOnce, init_fast_copy);
+    if (size >= FAST_COPY_PARALLEL_THRESHOLD && !atomic_load(&workersStarted)) {
+        start_workers();
+    }
+
+    //if another thread is already using the workers just do the copy ourselves
+    if (size < FAST_COPY_PARALLEL_THRESHOLD || pool.workerCount == 0 || pthread_mutex_trylock(&pool.busy) != 0) {
+        copyFunc(dst, src, size);
+        return;
+    }
+
+    //keep each chunk a multiple of the cache line size
+    size_t chunk = ((size / (pool.workerCount + 1)) + 63) & ~((size_t) 63);
+
+    pthread_mutex_lock(&pool.mutex);
+    pool.dst = dst;
+    pool.src = src;
+    pool.size = size;
+    pool.chunk = chunk;
+    pool.pending = pool.workerCount;
+    pool.generation++;
+    pthread_cond_broadcast(&pool.start);
+    pthread_mutex_unlock(&pool.mutex);
+
+    copyFunc(dst, src, chunk);
+
+    pthread_mutex_lock(&pool.mutex);
+    while (pool.pending > 0) {
+        pthread_cond_wait(&pool.done, &pool.mutex);
+    }
+    pthread_mutex_unlock(&pool.mutex);
+
+    pthread_mutex_unlock(&pool.busy);
+}
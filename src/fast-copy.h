@@ -0,0 +1,15 @@
+#ifndef FAST_COPY_H
+#define FAST_COPY_H
+
+#include <stddef.h>
+
+//memcpy replacement for large bitstream payloads that the CPU won't read again, anything the CPU is going to parse
+//should be copied with memcpy instead so it stays in cache.
+//Above a threshold this uses non-temporal stores to avoid evicting the rest of the cache, and for very large
+//copies the work is split across a few worker threads. Small copies just go to memcpy.
+void fast_copy(void *dst, const void *src, size_t size);
+
+//stops the worker threads, they're started again by the next large copy
+void release_fast_copy(void);
+
+#endif // FAST_COPY_H
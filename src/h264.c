@@ -95,10 +95,10 @@ static void copyH264SliceData(NVContext *ctx, NVBuffer* buf, CUVIDPICPARAMS *pic
         static const uint8_t header[] = { 0, 0, 1 }; //1 as a 24-bit Big Endian
 
         VASliceParameterBufferH264 *sliceParams = &((VASliceParameterBufferH264*) ctx->lastSliceParams)[i];
-        uint32_t offset = (uint32_t) ctx->bitstreamBuffer.size;
-        appendBuffer(&ctx->sliceOffsets, &offset, sizeof(offset));
-        appendBuffer(&ctx->bitstreamBuffer, header, sizeof(header));
-        appendBuffer(&ctx->bitstreamBuffer, PTROFF(buf->ptr, sliceParams->slice_data_offset), sliceParams->slice_data_size);
+        uint32_t offset = appendSliceData(ctx, buf, sliceParams->slice_data_offset, sliceParams->slice_data_size, header, sizeof(header));
+        if (!appendBuffer(&ctx->sliceOffsets, &offset, sizeof(offset))) {
+            ctx->bitstreamFailed = true;
+        }
         picParams->nBitstreamDataLen += sliceParams->slice_data_size + 3;
     }
 }
@@ -141,4 +141,6 @@ const DECLARE_CODEC(h264Codec) = {
     },
     .supportedProfileCount = ARRAY_SIZE(h264SupportedProfiles),
     .supportedProfiles = h264SupportedProfiles,
+    .sliceDataInArena = true,
+    .sliceDataHeaderSize = 3,
 };
@@ -0,0 +1,121 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "handle-table.h"
+
+void init_handle_table(HandleTable *table) {
+    for (uint32_t i = 0; i < HANDLE_MAX_PAGES; i++) {
+        atomic_init(&table->pages[i], NULL);
+    }
+    table->size = 0;
+    table->count = 0;
+    table->freeHead = UINT32_MAX;
+}
+
+static uint32_t make_handle(uint32_t slot, uint32_t generation) {
+    return (generation << HANDLE_SLOT_BITS) | slot;
+}
+
+static uint32_t next_generation(uint32_t generation) {
+    //generation 0 is never used so a handle is never 0, and the top generation is skipped
+    //so we never hand out VA_INVALID_ID (0xffffffff)
+    return generation >= HANDLE_GENERATION_MAX ? 1 : generation + 1;
+}
+
+static int ensure_page(HandleTable *table, uint32_t slot) {
+    uint32_t page = slot >> HANDLE_PAGE_BITS;
+    if (atomic_load(&table->pages[page]) != NULL) {
+        return 1;
+    }
+
+    HandleSlot *slots = calloc(HANDLE_PAGE_SIZE, sizeof(HandleSlot));
+    if (slots == NULL) {
+        return 0;
+    }
+
+    //publish the page only once it's been zeroed, readers may see it straight away
+    atomic_store(&table->pages[page], slots);
+    return 1;
+}
+
+uint32_t add_handle(HandleTable *table, void *element) {
+    uint32_t slot;
+
+    if (table->freeHead != UINT32_MAX) {
+        //reuse the most recently freed slot, it's the most likely to still be in cache
+        slot = table->freeHead;
+        table->freeHead = handle_slot_at(table, slot)->nextFree;
+    } else {
+        if (table->size >= HANDLE_MAX_SLOTS || !ensure_page(table, table->size)) {
+            return HANDLE_INVALID;
+        }
+        slot = table->size++;
+    }
+
+    HandleSlot *s = handle_slot_at(table, slot);
+    s->generation = next_generation(s->generation);
+    s->nextFree = UINT32_MAX;
+    //the element has to be visible before the handle, as that's what readers check first
+    atomic_store(&s->element, element);
+    atomic_store(&s->handle, make_handle(slot, s->generation));
+    table->count++;
+
+    return make_handle(slot, s->generation);
+}
+
+void *get_handle(HandleTable *table, uint32_t handle) {
+    uint32_t slot = handle & HANDLE_SLOT_MASK;
+    if (handle == HANDLE_INVALID) {
+        return NULL;
+    }
+
+    HandleSlot *page = atomic_load(&table->pages[slot >> HANDLE_PAGE_BITS]);
+    if (page == NULL) {
+        return NULL;
+    }
+
+    //a handle from a previous generation won't match the handle currently stored in the slot
+    HandleSlot *s = &page[slot & HANDLE_PAGE_MASK];
+    if (atomic_load(&s->handle) != handle) {
+        return NULL;
+    }
+
+    void *element = atomic_load(&s->element);
+
+    //check the handle again, if the slot was removed (and maybe reused) while we were reading the
+    //element then the handle will have changed, as remove_handle clears it before touching the element
+    if (atomic_load(&s->handle) != handle) {
+        return NULL;
+    }
+
+    return element;
+}
+
+void *remove_handle(HandleTable *table, uint32_t handle) {
+    uint32_t slot = handle & HANDLE_SLOT_MASK;
+    if (handle == HANDLE_INVALID || slot >= table->size) {
+        return NULL;
+    }
+
+    HandleSlot *s = handle_slot_at(table, slot);
+    if (atomic_load(&s->handle) != handle) {
+        return NULL;
+    }
+
+    void *element = atomic_load(&s->element);
+    atomic_store(&s->handle, HANDLE_INVALID);
+    atomic_store(&s->element, NULL);
+    s->nextFree = table->freeHead;
+    table->freeHead = slot;
+    table->count--;
+
+    return element;
+}
+
+void free_handle_table(HandleTable *table) {
+    for (uint32_t i = 0; i < HANDLE_MAX_PAGES; i++) {
+        free(atomic_load(&table->pages[i]));
+    }
+    init_handle_table(table);
+}
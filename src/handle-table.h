@@ -0,0 +1,70 @@
+#ifndef HANDLE_TABLE_H
+#define HANDLE_TABLE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+
+//A slot indexed table that maps 32-bit handles to pointers.
+//The low bits of each handle are the slot index, the high bits are a generation counter that is bumped
+//every time the slot is reused, so a stale handle will never resolve to a newer element.
+//
+//Lookups don't take any locks. Slots are allocated in fixed size pages that are never moved or freed
+//while the table is alive, and each slot is published atomically, so get_handle can race with
+//add_handle/remove_handle safely. Writers (add/remove/iteration) must still be serialised by the caller.
+#define HANDLE_SLOT_BITS        20
+#define HANDLE_SLOT_MASK        ((1u << HANDLE_SLOT_BITS) - 1)
+#define HANDLE_MAX_SLOTS        (1u << HANDLE_SLOT_BITS)
+#define HANDLE_GENERATION_MAX   ((1u << (32 - HANDLE_SLOT_BITS)) - 2)
+
+#define HANDLE_PAGE_BITS        10
+#define HANDLE_PAGE_SIZE        (1u << HANDLE_PAGE_BITS)
+#define HANDLE_PAGE_MASK        (HANDLE_PAGE_SIZE - 1)
+#define HANDLE_MAX_PAGES        (HANDLE_MAX_SLOTS >> HANDLE_PAGE_BITS)
+
+#define HANDLE_INVALID          0
+
+typedef struct {
+    _Atomic(void*)      element;
+    //the handle currently stored in this slot, or HANDLE_INVALID if it's free
+    _Atomic(uint32_t)   handle;
+    uint32_t            generation;
+    //index of the next free slot, only valid while this slot is on the free list
+    uint32_t            nextFree;
+} HandleSlot;
+
+typedef struct {
+    _Atomic(HandleSlot*) pages[HANDLE_MAX_PAGES];
+    //number of slots that have ever been used
+    uint32_t    size;
+    //number of live handles
+    uint32_t    count;
+    //head of the free list, UINT32_MAX if empty
+    uint32_t    freeHead;
+} HandleTable;
+
+static inline HandleSlot *handle_slot_at(HandleTable *table, uint32_t slot) {
+    return &atomic_load(&table->pages[slot >> HANDLE_PAGE_BITS])[slot & HANDLE_PAGE_MASK];
+}
+
+//Must be called with the writer lock held. Usage:
+//    HANDLE_TABLE_FOR_EACH(void*, it, table)
+//        printf("%u: %p\n", it_handle, it);
+//    END_FOR_EACH
+#define HANDLE_TABLE_FOR_EACH(T, N, H) for (uint32_t N ## _idx = 0; N ## _idx < (H)->size; N ## _idx++) { \
+    HandleSlot *N ## _slot = handle_slot_at((H), N ## _idx); \
+    if (atomic_load(&N ## _slot->handle) == HANDLE_INVALID) continue; \
+    uint32_t N ## _handle = atomic_load(&N ## _slot->handle); T N = (T) atomic_load(&N ## _slot->element);
+#define END_FOR_EACH }
+
+void init_handle_table(HandleTable *table);
+
+uint32_t add_handle(HandleTable *table, void *element);
+
+void *get_handle(HandleTable *table, uint32_t handle);
+
+void *remove_handle(HandleTable *table, uint32_t handle);
+
+void free_handle_table(HandleTable *table);
+
+#endif // HANDLE_TABLE_H
@@ -256,10 +256,10 @@ static void copyHEVCSliceData(NVContext *ctx, NVBuffer* buf, CUVIDPICPARAMS *pic
         static const uint8_t header[] = { 0, 0, 1 }; //1 as a 24-bit Big Endian
 
         VASliceParameterBufferH264 *sliceParams = &((VASliceParameterBufferH264*) ctx->lastSliceParams)[i];
-        uint32_t offset = (uint32_t) ctx->bitstreamBuffer.size;
-        appendBuffer(&ctx->sliceOffsets, &offset, sizeof(offset));
-        appendBuffer(&ctx->bitstreamBuffer, header, sizeof(header));
-        appendBuffer(&ctx->bitstreamBuffer, PTROFF(buf->ptr, sliceParams->slice_data_offset), sliceParams->slice_data_size);
+        uint32_t offset = appendSliceData(ctx, buf, sliceParams->slice_data_offset, sliceParams->slice_data_size, header, sizeof(header));
+        if (!appendBuffer(&ctx->sliceOffsets, &offset, sizeof(offset))) {
+            ctx->bitstreamFailed = true;
+        }
         picParams->nBitstreamDataLen += sliceParams->slice_data_size + 3;
     }
 }
@@ -323,4 +323,6 @@ const DECLARE_CODEC(hevcCodec) = {
     },
     .supportedProfileCount = ARRAY_SIZE(hevcSupportedProfiles),
     .supportedProfiles = hevcSupportedProfiles,
+    .sliceDataInArena = true,
+    .sliceDataHeaderSize = 3,
 };
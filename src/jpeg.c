@@ -31,9 +31,10 @@ static void copyJPEGSliceData(NVContext *ctx, NVBuffer* buf, CUVIDPICPARAMS *pic
     for (int i = 0; i < ctx->lastSliceParamsCount; i++)
     {
         VASliceParameterBufferJPEGBaseline *sliceParams = &((VASliceParameterBufferJPEGBaseline*) ctx->lastSliceParams)[i];
-        uint32_t offset = (uint32_t) ctx->bitstreamBuffer.size;
-        appendBuffer(&ctx->sliceOffsets, &offset, sizeof(offset));
-        appendBuffer(&ctx->bitstreamBuffer, PTROFF(buf->ptr, sliceParams->slice_data_offset), sliceParams->slice_data_size);
+        uint32_t offset = appendSliceData(ctx, buf, sliceParams->slice_data_offset, sliceParams->slice_data_size, NULL, 0);
+        if (!appendBuffer(&ctx->sliceOffsets, &offset, sizeof(offset))) {
+            ctx->bitstreamFailed = true;
+        }
         picParams->nBitstreamDataLen += sliceParams->slice_data_size;
     }
 }
@@ -62,5 +63,6 @@ const DECLARE_CODEC(jpegCodec) = {
     },
     .supportedProfileCount = ARRAY_SIZE(jpegSupportedProfiles),
     .supportedProfiles = jpegSupportedProfiles,
+    .sliceDataInArena = true,
 };
 */
@@ -57,6 +57,7 @@ static void copyMPEG2PicParam(NVContext *ctx, NVBuffer* buffer, CUVIDPICPARAMS *
     picParams->field_pic_flag    = buf->picture_coding_extension.bits.picture_structure != 3;
     picParams->bottom_field_flag = buf->picture_coding_extension.bits.picture_structure == 2; //PICT_BOTTOM_FIELD
     picParams->second_field      = picParams->field_pic_flag && !buf->picture_coding_extension.bits.is_first_field;
+    ctx->pictureHidden           = picParams->field_pic_flag && !picParams->second_field;
 
     picParams->intra_pic_flag    = buf->picture_coding_type == 1; //Intra
     picParams->ref_pic_flag      = buf->picture_coding_type == 1 || //Intra
@@ -94,9 +95,10 @@ static void copyMPEG2SliceData(NVContext *ctx, NVBuffer* buf, CUVIDPICPARAMS *pi
     for (int i = 0; i < ctx->lastSliceParamsCount; i++)
     {
         VASliceParameterBufferMPEG2 *sliceParams = &((VASliceParameterBufferMPEG2*) ctx->lastSliceParams)[i];
-        uint32_t offset = (uint32_t) ctx->bitstreamBuffer.size;
-        appendBuffer(&ctx->sliceOffsets, &offset, sizeof(offset));
-        appendBuffer(&ctx->bitstreamBuffer, PTROFF(buf->ptr, sliceParams->slice_data_offset), sliceParams->slice_data_size);
+        uint32_t offset = appendSliceData(ctx, buf, sliceParams->slice_data_offset, sliceParams->slice_data_size, NULL, 0);
+        if (!appendBuffer(&ctx->sliceOffsets, &offset, sizeof(offset))) {
+            ctx->bitstreamFailed = true;
+        }
         picParams->nBitstreamDataLen += sliceParams->slice_data_size;
     }
 }
@@ -156,4 +158,5 @@ const DECLARE_CODEC(mpeg2Codec) = {
     },
     .supportedProfileCount = ARRAY_SIZE(mpeg2SupportedProfiles),
     .supportedProfiles = mpeg2SupportedProfiles,
+    .sliceDataInArena = true,
 };
@@ -69,9 +69,10 @@ static void copyMPEG4SliceData(NVContext *ctx, NVBuffer* buf, CUVIDPICPARAMS *pi
     {
         VASliceParameterBufferMPEG4 *sliceParams = &((VASliceParameterBufferMPEG4*) ctx->lastSliceParams)[i];
         LOG("here: %d", sliceParams->macroblock_offset);
-        uint32_t offset = (uint32_t) ctx->bitstreamBuffer.size;
-        appendBuffer(&ctx->sliceOffsets, &offset, sizeof(offset));
-        appendBuffer(&ctx->bitstreamBuffer, PTROFF(buf->ptr, sliceParams->slice_data_offset), sliceParams->slice_data_size);
+        uint32_t offset = appendSliceData(ctx, buf, sliceParams->slice_data_offset, sliceParams->slice_data_size, NULL, 0);
+        if (!appendBuffer(&ctx->sliceOffsets, &offset, sizeof(offset))) {
+            ctx->bitstreamFailed = true;
+        }
         picParams->nBitstreamDataLen += sliceParams->slice_data_size;
     }
 }
@@ -121,6 +122,7 @@ const DECLARE_CODEC(mpeg4Codec) = {
     },
     .supportedProfileCount = ARRAY_SIZE(mpeg4SupportProfiles),
     .supportedProfiles = mpeg4SupportProfiles,
+    .sliceDataInArena = true,
 };
 */
 
@@ -0,0 +1,98 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+
+#include "numa.h"
+
+static int read_numa_node(const char *path) {
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        return -1;
+    }
+
+    int node = -1;
+    if (fscanf(f, "%d", &node) != 1) {
+        node = -1;
+    }
+    fclose(f);
+
+    //single node systems report -1 as well
+    return node;
+}
+
+int numa_node_from_pci_bus_id(const char *busId) {
+    char path[128];
+    snprintf(path, sizeof(path), "/sys/bus/pci/devices/%s/numa_node", busId);
+    return read_numa_node(path);
+}
+
+int numa_node_from_drm_fd(int fd) {
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || !S_ISCHR(st.st_mode)) {
+        return -1;
+    }
+
+    char path[128];
+    snprintf(path, sizeof(path), "/sys/dev/char/%u:%u/device/numa_node", major(st.st_rdev), minor(st.st_rdev));
+    return read_numa_node(path);
+}
+
+bool numa_node_cpus(int node, cpu_set_t *cpus) {
+    char path[128];
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        return false;
+    }
+
+    char list[4096];
+    bool ret = fgets(list, sizeof(list), f) != NULL;
+    fclose(f);
+    if (!ret) {
+        return false;
+    }
+
+    //the list is made up of comma separated CPUs or ranges, e.g. "0-7,16-23"
+    CPU_ZERO(cpus);
+    char *save = NULL;
+    for (char *tok = strtok_r(list, ",\n", &save); tok != NULL; tok = strtok_r(NULL, ",\n", &save)) {
+        int first, last;
+        int n = sscanf(tok, "%d-%d", &first, &last);
+        if (n < 1) {
+            continue;
+        } else if (n == 1) {
+            last = first;
+        }
+        for (int cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++) {
+            CPU_SET(cpu, cpus);
+        }
+    }
+
+    return CPU_COUNT(cpus) > 0;
+}
+
+bool numa_prefer_node(int node) {
+    if (node < 0 || node >= (int) (sizeof(unsigned long) * 8)) {
+        return false;
+    }
+
+    //don't override a policy the application has set up itself
+    int mode = MPOL_DEFAULT;
+    if (syscall(SYS_get_mempolicy, &mode, NULL, 0, NULL, 0) != 0 || mode != MPOL_DEFAULT) {
+        return false;
+    }
+
+    unsigned long mask = 1ul << node;
+    return syscall(SYS_set_mempolicy, MPOL_PREFERRED, &mask, sizeof(mask) * 8 + 1) == 0;
+}
+
+void numa_restore_policy(void) {
+    syscall(SYS_set_mempolicy, MPOL_DEFAULT, NULL, 0);
+}
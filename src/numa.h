@@ -0,0 +1,24 @@
+#ifndef NUMA_H
+#define NUMA_H
+
+#include <stdbool.h>
+#include <sched.h>
+
+//Helpers for finding which NUMA node a device is attached to, and keeping threads and memory on it.
+//These only use sysfs and raw syscalls, so there's no dependency on libnuma. Nodes are -1 when unknown.
+
+//busId is in the sysfs format, e.g. "0000:01:00.0"
+int numa_node_from_pci_bus_id(const char *busId);
+
+int numa_node_from_drm_fd(int fd);
+
+//fills cpus with the CPUs that belong to the node, returns false if the node doesn't exist
+bool numa_node_cpus(int node, cpu_set_t *cpus);
+
+//makes the calling thread prefer allocating pages from the node, but only if it's using the default policy,
+//returns true if the policy was changed and numa_restore_policy needs to be called
+bool numa_prefer_node(int node);
+
+void numa_restore_policy(void);
+
+#endif // NUMA_H
@@ -0,0 +1,76 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <malloc.h>
+
+#include "slab.h"
+
+static size_t round_up(size_t size, size_t alignment) {
+    return (size + alignment - 1) & ~(alignment - 1);
+}
+
+void init_slab(Slab *slab, size_t blockSize, uint32_t blocksPerChunk) {
+    //every block needs to be able to hold the free list link, and we keep them cache line aligned
+    //so objects from different blocks never share a line
+    slab->blockSize = round_up(blockSize < sizeof(void*) ? sizeof(void*) : blockSize, SLAB_ALIGNMENT);
+    slab->blocksPerChunk = blocksPerChunk > 0 ? blocksPerChunk : 1;
+    slab->freeList = NULL;
+    slab->chunks = NULL;
+    slab->chunkCount = 0;
+    slab->liveCount = 0;
+}
+
+static int grow_slab(Slab *slab) {
+    //the first block of each chunk is reserved for the chunk link
+    size_t chunkSize = slab->blockSize * (slab->blocksPerChunk + 1);
+    char *chunk = memalign(SLAB_ALIGNMENT, chunkSize);
+    if (chunk == NULL) {
+        return 0;
+    }
+
+    *(void**) chunk = slab->chunks;
+    slab->chunks = chunk;
+    slab->chunkCount++;
+
+    //push the blocks in reverse so they get handed out in address order
+    for (uint32_t i = slab->blocksPerChunk; i > 0; i--) {
+        void *block = chunk + (i * slab->blockSize);
+        *(void**) block = slab->freeList;
+        slab->freeList = block;
+    }
+
+    return 1;
+}
+
+void *slab_alloc(Slab *slab) {
+    if (slab->freeList == NULL && !grow_slab(slab)) {
+        return NULL;
+    }
+
+    void *block = slab->freeList;
+    slab->freeList = *(void**) block;
+    slab->liveCount++;
+
+    memset(block, 0, slab->blockSize);
+    return block;
+}
+
+void slab_free(Slab *slab, void *block) {
+    if (block == NULL) {
+        return;
+    }
+
+    *(void**) block = slab->freeList;
+    slab->freeList = block;
+    slab->liveCount--;
+}
+
+void free_slab(Slab *slab) {
+    void *chunk = slab->chunks;
+    while (chunk != NULL) {
+        void *next = *(void**) chunk;
+        free(chunk);
+        chunk = next;
+    }
+    init_slab(slab, slab->blockSize, slab->blocksPerChunk);
+}
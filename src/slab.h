@@ -0,0 +1,31 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+//A simple fixed size block allocator. Blocks are carved out of larger chunks and recycled through a
+//free list, so steady state allocation never touches malloc. Chunks are only released by free_slab.
+//Not thread safe, callers need to provide their own locking.
+#define SLAB_ALIGNMENT 64
+
+typedef struct {
+    size_t      blockSize;
+    uint32_t    blocksPerChunk;
+    //singly linked list of free blocks, the link is stored in the block itself
+    void        *freeList;
+    //singly linked list of chunks, the link is stored at the start of each chunk
+    void        *chunks;
+    uint32_t    chunkCount;
+    uint32_t    liveCount;
+} Slab;
+
+void init_slab(Slab *slab, size_t blockSize, uint32_t blocksPerChunk);
+
+void *slab_alloc(Slab *slab);
+
+void slab_free(Slab *slab, void *block);
+
+void free_slab(Slab *slab);
+
+#endif // SLAB_H
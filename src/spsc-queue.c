@@ -0,0 +1,110 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "spsc-queue.h"
+
+static void futex_wait(_Atomic(uint32_t) *addr, uint32_t expected) {
+    syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, expected, NULL, NULL, 0);
+}
+
+static void futex_wake(_Atomic(uint32_t) *addr, int count) {
+    syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
+
+bool init_spsc_queue(SpscQueue *queue, uint32_t capacity) {
+    memset(queue, 0, sizeof(SpscQueue));
+
+    uint32_t size = 1;
+    while (size < capacity && size < (1u << 30)) {
+        size <<= 1;
+    }
+
+    queue->slots = calloc(size, sizeof(void*));
+    if (queue->slots == NULL) {
+        return false;
+    }
+    queue->capacity = size;
+    queue->mask = size - 1;
+    atomic_init(&queue->head, 0);
+    atomic_init(&queue->tail, 0);
+    atomic_init(&queue->producerSeq, 0);
+    atomic_init(&queue->producerWaiting, 0);
+    atomic_init(&queue->closed, false);
+
+    return true;
+}
+
+void free_spsc_queue(SpscQueue *queue) {
+    free(queue->slots);
+    queue->slots = NULL;
+}
+
+uint32_t spsc_queue_size(SpscQueue *queue) {
+    return atomic_load(&queue->head) - atomic_load(&queue->tail);
+}
+
+bool spsc_queue_push(SpscQueue *queue, void *element) {
+    if (atomic_load(&queue->closed)) {
+        return false;
+    }
+
+    uint32_t head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+    bool stalled = false;
+
+    while (head - atomic_load(&queue->tail) >= queue->capacity) {
+        if (atomic_load(&queue->closed)) {
+            return false;
+        }
+        if (!stalled) {
+            stalled = true;
+            queue->stalls++;
+        }
+
+        //announce we're waiting, then check again so we can't miss the consumer making space
+        uint32_t seq = atomic_load(&queue->producerSeq);
+        atomic_store(&queue->producerWaiting, 1);
+        if (head - atomic_load(&queue->tail) >= queue->capacity && !atomic_load(&queue->closed)) {
+            futex_wait(&queue->producerSeq, seq);
+        }
+        atomic_store(&queue->producerWaiting, 0);
+    }
+
+    queue->slots[head & queue->mask] = element;
+    atomic_store(&queue->head, head + 1);
+
+    uint32_t size = head + 1 - atomic_load(&queue->tail);
+    if (size > queue->highWater) {
+        queue->highWater = size;
+    }
+
+    return true;
+}
+
+bool spsc_queue_try_pop(SpscQueue *queue, void **element) {
+    uint32_t tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+    if (tail == atomic_load(&queue->head)) {
+        return false;
+    }
+
+    *element = queue->slots[tail & queue->mask];
+    atomic_store(&queue->tail, tail + 1);
+
+    if (atomic_load(&queue->producerWaiting)) {
+        atomic_fetch_add(&queue->producerSeq, 1);
+        futex_wake(&queue->producerSeq, 1);
+    }
+
+    return true;
+}
+
+void spsc_queue_close(SpscQueue *queue) {
+    atomic_store(&queue->closed, true);
+    atomic_fetch_add(&queue->producerSeq, 1);
+    futex_wake(&queue->producerSeq, INT_MAX);
+}
@@ -0,0 +1,47 @@
+#ifndef SPSC_QUEUE_H
+#define SPSC_QUEUE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+//A bounded lock-free queue for exactly one producer thread and one consumer thread.
+//Pushing to a full queue blocks until there's space, popping never blocks. A blocked producer sleeps on a futex,
+//which is only touched if it's actually waiting, so the common case is a couple of atomic operations per element.
+#define SPSC_QUEUE_PAD 64
+
+typedef struct {
+    //written by the producer
+    _Atomic(uint32_t)   head;
+    _Atomic(uint32_t)   producerSeq;
+    _Atomic(uint32_t)   producerWaiting;
+    uint32_t            highWater;
+    uint32_t            stalls;
+    char                pad0[SPSC_QUEUE_PAD];
+    //written by the consumer, kept at least a cache line away from the producer's fields
+    _Atomic(uint32_t)   tail;
+    char                pad1[SPSC_QUEUE_PAD];
+    //read only after init
+    void                **slots;
+    uint32_t            capacity;
+    uint32_t            mask;
+    _Atomic(bool)       closed;
+} SpscQueue;
+
+//capacity is rounded up to a power of two
+bool init_spsc_queue(SpscQueue *queue, uint32_t capacity);
+
+void free_spsc_queue(SpscQueue *queue);
+
+//blocks while the queue is full, returns false if the queue has been closed
+bool spsc_queue_push(SpscQueue *queue, void *element);
+
+//returns false if the queue is empty
+bool spsc_queue_try_pop(SpscQueue *queue, void **element);
+
+uint32_t spsc_queue_size(SpscQueue *queue);
+
+//wakes up a blocked producer, no more elements can be pushed but any remaining ones can still be popped
+void spsc_queue_close(SpscQueue *queue);
+
+#endif // SPSC_QUEUE_H
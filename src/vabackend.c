@@ -4,6 +4,7 @@
 
 #include <stdio.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <stdlib.h>
 #include <string.h>
 #include <malloc.h>
@@ -26,6 +27,7 @@
 #include <stdarg.h>
 
 #include <time.h>
+#include <errno.h>
 
 pthread_mutex_t concurrency_mutex = PTHREAD_MUTEX_INITIALIZER;
 static uint32_t instances;
@@ -33,6 +35,7 @@ static uint32_t max_instances = 0;
 
 static CudaFunctions *cu;
 static CuvidFunctions *cv;
+static CudaExtraFunctions *cux;
 
 extern const NVCodec __start_nvd_codecs[];
 extern const NVCodec __stop_nvd_codecs[];
@@ -40,6 +43,21 @@ extern const NVCodec __stop_nvd_codecs[];
 static FILE *LOG_OUTPUT;
 
 static int gpu = -1;
+static bool pinnedBitstream = false;
+static bool asyncSubmit = false;
+static uint32_t surfaceQueueDepth = SURFACE_QUEUE_SIZE;
+static int outputSurfaces = 2;
+static bool lazyResolve = false;
+static int resolveThreads = 0;
+//-2 to find the GPU's node automatically, -1 to disable NUMA placement
+static int numaNodeOverride = -2;
+//contexts with this many pixels or fewer default to low priority, 0 to disable
+static int64_t lowPriorityPixels = 0;
+//make the context current once per thread and leave it there, rather than pushing and popping it on every call
+static bool bindContext = false;
+static bool capsCache = true;
+//use the GPU's primary context, shared by every driver instance in the process, rather than creating one per instance
+static bool sharedContext = true;
 static enum {
     EGL, DIRECT
 } backend = EGL;
@@ -100,6 +118,64 @@ static void init() {
         max_instances = atoi(nvdMaxInstances);
     }
 
+    char *nvdPinned = getenv("NVD_PINNED_BITSTREAM");
+    if (nvdPinned != NULL) {
+        pinnedBitstream = atoi(nvdPinned) != 0;
+    }
+
+    char *nvdAsyncSubmit = getenv("NVD_ASYNC_SUBMIT");
+    if (nvdAsyncSubmit != NULL) {
+        asyncSubmit = atoi(nvdAsyncSubmit) != 0;
+    }
+
+    char *nvdQueueDepth = getenv("NVD_SURFACE_QUEUE_DEPTH");
+    if (nvdQueueDepth != NULL && atoi(nvdQueueDepth) > 0) {
+        surfaceQueueDepth = atoi(nvdQueueDepth);
+    }
+
+    char *nvdOutputSurfaces = getenv("NVD_OUTPUT_SURFACES");
+    if (nvdOutputSurfaces != NULL) {
+        outputSurfaces = MIN(MAX(atoi(nvdOutputSurfaces), 1), MAX_OUTPUT_SURFACES);
+    }
+
+    char *nvdLazyResolve = getenv("NVD_LAZY_RESOLVE");
+    if (nvdLazyResolve != NULL) {
+        lazyResolve = atoi(nvdLazyResolve) != 0;
+    }
+
+    char *nvdResolveThreads = getenv("NVD_RESOLVE_THREADS");
+    if (nvdResolveThreads != NULL) {
+        resolveThreads = atoi(nvdResolveThreads);
+    }
+
+    char *nvdNumaNode = getenv("NVD_NUMA_NODE");
+    if (nvdNumaNode != NULL) {
+        numaNodeOverride = MAX(atoi(nvdNumaNode), -1);
+    }
+
+    char *nvdLowPriority = getenv("NVD_LOW_PRIORITY_RESOLUTION");
+    if (nvdLowPriority != NULL) {
+        int width = 0, height = 0;
+        if (sscanf(nvdLowPriority, "%dx%d", &width, &height) == 2 && width > 0 && height > 0) {
+            lowPriorityPixels = (int64_t) width * height;
+        }
+    }
+
+    char *nvdBindContext = getenv("NVD_BIND_CONTEXT");
+    if (nvdBindContext != NULL) {
+        bindContext = atoi(nvdBindContext) != 0;
+    }
+
+    char *nvdCapsCache = getenv("NVD_CAPS_CACHE");
+    if (nvdCapsCache != NULL) {
+        capsCache = atoi(nvdCapsCache) != 0;
+    }
+
+    char *nvdSharedContext = getenv("NVD_SHARED_CONTEXT");
+    if (nvdSharedContext != NULL) {
+        sharedContext = atoi(nvdSharedContext) != 0;
+    }
+
     char *nvdBackend = getenv("NVD_BACKEND");
     if (nvdBackend != NULL && strncmp(nvdBackend, "direct", 6) == 0) {
         backend = DIRECT;
@@ -133,13 +209,27 @@ static void init() {
         LOG("Failed to load NVDEC functions");
         return;
     }
+    //these are optional, we can still work without them
+    ret = cuda_extra_load_functions(&cux);
+    if (ret != 0) {
+        cux = NULL;
+        LOG("Failed to load additional CUDA functions");
+    }
+}
+
+//cuInit is left until a driver instance first needs the GPU, it's enough to wake up a suspended GPU
+static pthread_once_t cudaInitOnce = PTHREAD_ONCE_INIT;
 
+static void initCuda(void) {
     //Not really much we can do here to abort the loading of the library
     CHECK_CUDA_RESULT(cu->cuInit(0));
 }
 
 __attribute__ ((destructor))
 static void cleanup() {
+    if (cux != NULL) {
+        cuda_extra_free_functions(&cux);
+    }
     if (cv != NULL) {
         cuvid_free_functions(&cv);
     }
@@ -177,45 +267,361 @@ bool checkCudaErrors(CUresult err, const char *file, const char *function, const
     return false;
 }
 
-void appendBuffer(AppendableBuffer *ab, const void *buf, uint64_t size) {
-  if (ab->buf == NULL) {
-      ab->allocated = size*2;
-      ab->buf = memalign(16, ab->allocated);
-      ab->size = 0;
-  } else if (ab->size + size > ab->allocated) {
-      while (ab->size + size > ab->allocated) {
-        ab->allocated += ab->allocated >> 1;
+//the contexts this thread has made current through pushContext, so nested or repeated calls with the same context don't
+//have to go back to the driver
+#define MAX_CONTEXT_DEPTH 4
+typedef struct {
+    CUcontext   context;
+    uint32_t    refs;
+    //false if the context was already bound, so there's nothing to pop
+    bool        pushed;
+} ThreadContext;
+static _Thread_local ThreadContext threadContexts[MAX_CONTEXT_DEPTH];
+static _Thread_local int threadContextDepth;
+//pushes made straight to the driver once threadContexts is full, they're always the innermost so they're popped first
+static _Thread_local uint32_t threadContextOverflow;
+
+static CUresult pushContext(CUcontext context) {
+    if (threadContextOverflow > 0 || threadContextDepth == MAX_CONTEXT_DEPTH) {
+        CUresult result = cu->cuCtxPushCurrent(context);
+        if (result == CUDA_SUCCESS) {
+            threadContextOverflow++;
+        }
+        return result;
+    }
+    if (threadContextDepth > 0 && threadContexts[threadContextDepth - 1].context == context) {
+        threadContexts[threadContextDepth - 1].refs++;
+        return CUDA_SUCCESS;
+    }
+
+    ThreadContext *tc = &threadContexts[threadContextDepth];
+    tc->context = context;
+    tc->refs = 1;
+    tc->pushed = true;
+
+    //in bind mode the outermost context is made current and left there, the application could have changed it since
+    //we last saw the thread though, so check with the driver (which is just a thread local lookup)
+    if (bindContext && threadContextDepth == 0 && cux != NULL && cux->cuCtxGetCurrent != NULL && cux->cuCtxSetCurrent != NULL) {
+        CUcontext current = NULL;
+        CUresult result = cux->cuCtxGetCurrent(&current);
+        if (result == CUDA_SUCCESS && current != context) {
+            result = cux->cuCtxSetCurrent(context);
+        }
+        if (result != CUDA_SUCCESS) {
+            return result;
+        }
+        tc->pushed = false;
+    } else {
+        CUresult result = cu->cuCtxPushCurrent(context);
+        if (result != CUDA_SUCCESS) {
+            return result;
+        }
+    }
+
+    threadContextDepth++;
+    return CUDA_SUCCESS;
+}
+
+static CUresult popContext(void) {
+    if (threadContextOverflow > 0) {
+        threadContextOverflow--;
+        return cu->cuCtxPopCurrent(NULL);
+    }
+    //not pushed by us, so leave it to the driver to complain
+    if (threadContextDepth == 0) {
+        return cu->cuCtxPopCurrent(NULL);
+    }
+
+    ThreadContext *tc = &threadContexts[threadContextDepth - 1];
+    if (--tc->refs > 0) {
+        return CUDA_SUCCESS;
+    }
+    threadContextDepth--;
+    return tc->pushed ? cu->cuCtxPopCurrent(NULL) : CUDA_SUCCESS;
+}
+
+//bind mode leaves the context current after the last popContext, so it has to be taken off this thread before it's released
+//other threads that called into the driver keep it until they next push a context, there's no way to reach them from here
+static void unbindContext(CUcontext context) {
+    if (!bindContext || cux == NULL || cux->cuCtxGetCurrent == NULL || cux->cuCtxSetCurrent == NULL) {
+        return;
+    }
+    CUcontext current = NULL;
+    if (cux->cuCtxGetCurrent(&current) == CUDA_SUCCESS && current == context) {
+        CHECK_CUDA_RESULT(cux->cuCtxSetCurrent(NULL));
+    }
+}
+
+//how many resets between checks on whether an AppendableBuffer is much larger than it needs to be, 0 to never shrink
+#define APPENDABLE_BUFFER_DECAY_INTERVAL    256
+#define APPENDABLE_BUFFER_MIN_SIZE          (64 * 1024)
+
+//allocates memory for an AppendableBuffer, page-locked if the buffer asks for it and the driver lets us
+static void *allocBufferMemory(AppendableBuffer *ab, uint64_t size, bool *pinned) {
+  *pinned = false;
+  if (ab->pinContext != NULL && cux != NULL && cux->cuMemHostAlloc != NULL && cux->cuMemFreeHost != NULL
+          && pushContext(ab->pinContext) == CUDA_SUCCESS) {
+      void *ptr = NULL;
+      //the pages are faulted in by this call, so they'll follow our policy rather than wherever the caller happens to be running
+      bool preferred = numa_prefer_node(ab->numaNode);
+      CUresult result = cux->cuMemHostAlloc(&ptr, size, ab->pinFlags);
+      if (preferred) {
+          numa_restore_policy();
+      }
+      popContext();
+      if (result == CUDA_SUCCESS) {
+          *pinned = true;
+          return ptr;
+      }
+      LOG("Unable to allocate %" PRIu64 " bytes of page-locked memory (%d), falling back to pageable memory", size, result);
+  }
+  return memalign(64, size);
+}
+
+static void freeBufferMemory(AppendableBuffer *ab, void *ptr, bool pinned) {
+  if (ptr == NULL) {
+      return;
+  }
+  if (pinned && pushContext(ab->pinContext) == CUDA_SUCCESS) {
+      cux->cuMemFreeHost(ptr);
+      popContext();
+  } else if (!pinned) {
+      free(ptr);
+  }
+}
+
+//replaces the buffer's memory with an empty allocation of the given size
+static void reallocBuffer(AppendableBuffer *ab, uint64_t size) {
+  freeBufferMemory(ab, ab->buf, ab->pinned);
+  ab->buf = allocBufferMemory(ab, size, &ab->pinned);
+  ab->allocated = ab->buf != NULL ? size : 0;
+  ab->size = 0;
+}
+
+//makes sure there's room for another size bytes, returning where they should be written, or NULL if the buffer
+//couldn't be grown (in which case it's left as it was)
+void *reserveBuffer(AppendableBuffer *ab, uint64_t size) {
+  if (ab->size + size > ab->allocated) {
+      uint64_t allocated = ab->allocated > 0 ? ab->allocated : MAX(size * 2, 4096);
+      while (ab->size + size > allocated) {
+        allocated += allocated >> 1;
+      }
+      bool pinned;
+      void *nb = allocBufferMemory(ab, allocated, &pinned);
+      if (nb == NULL) {
+          LOG("Unable to grow buffer to %" PRIu64 " bytes", allocated);
+          return NULL;
+      }
+      if (ab->buf != NULL) {
+          memcpy(nb, ab->buf, ab->size);
+          freeBufferMemory(ab, ab->buf, ab->pinned);
       }
-      void *nb = memalign(16, ab->allocated);
-      memcpy(nb, ab->buf, ab->size);
-      free(ab->buf);
       ab->buf = nb;
+      ab->allocated = allocated;
+      ab->pinned = pinned;
   }
-  memcpy(PTROFF(ab->buf, ab->size), buf, size);
+  return PTROFF(ab->buf, ab->size);
+}
+
+//marks size bytes written after a call to reserveBuffer as used
+void commitBuffer(AppendableBuffer *ab, uint64_t size) {
   ab->size += size;
 }
 
+bool appendBuffer(AppendableBuffer *ab, const void *buf, uint64_t size) {
+  void *dst = reserveBuffer(ab, size);
+  if (dst == NULL) {
+      return false;
+  }
+  memcpy(dst, buf, size);
+  commitBuffer(ab, size);
+  return true;
+}
+
+//empties the buffer, but keeps the allocation around for next time unless it's been consistently oversized
+void resetBuffer(AppendableBuffer *ab) {
+  ab->highWater = MAX(ab->highWater, ab->size);
+  ab->size = 0;
+
+  if (APPENDABLE_BUFFER_DECAY_INTERVAL > 0 && ++ab->resets >= APPENDABLE_BUFFER_DECAY_INTERVAL) {
+      uint64_t wanted = MAX(ab->highWater * 2, APPENDABLE_BUFFER_MIN_SIZE);
+      if (ab->allocated > wanted * 2) {
+          reallocBuffer(ab, wanted);
+      }
+      ab->highWater = 0;
+      ab->resets = 0;
+  }
+}
+
 void freeBuffer(AppendableBuffer *ab) {
   if (ab->buf != NULL) {
-      free(ab->buf);
+      freeBufferMemory(ab, ab->buf, ab->pinned);
       ab->buf = NULL;
       ab->size = 0;
       ab->allocated = 0;
+      ab->pinned = false;
   }
+  ab->highWater = 0;
+  ab->resets = 0;
 }
 
-static Object allocateObject(NVDriver *drv, ObjectType type, int allocatePtrSize) {
-    Object newObj = (Object) calloc(1, sizeof(struct Object_t));
+//initial size of a context's slice data arena, it'll grow to fit the largest picture seen
+#define SLICE_ARENA_INITIAL_SIZE    (1024 * 1024)
 
-    newObj->type = type;
-    newObj->id = (++drv->nextObjId);
+static void *reserveSliceData(NVContext *ctx, uint32_t size) {
+    uint64_t needed = ctx->codec->sliceDataHeaderSize + (uint64_t) size;
+    void *ret = NULL;
+
+    pthread_mutex_lock(&ctx->sliceArenaMutex);
+    if (ctx->sliceArenaOutstanding == 0 && ctx->bitstreamArenaSize == 0) {
+        //nothing refers to the arena anymore, so we can start again from the beginning
+        //this is also the only time it's safe to grow it
+        ctx->sliceArena.size = 0;
+        if (ctx->sliceArenaWanted > ctx->sliceArena.allocated) {
+            reallocBuffer(&ctx->sliceArena, ctx->sliceArenaWanted);
+        }
+    }
+
+    if (ctx->sliceArena.size + needed <= ctx->sliceArena.allocated) {
+        //slices are placed back to back, with room for the header in front, so consecutive slices
+        //end up forming a contiguous bitstream
+        ret = PTROFF(ctx->sliceArena.buf, ctx->sliceArena.size + ctx->codec->sliceDataHeaderSize);
+        ctx->sliceArena.size += needed;
+        ctx->sliceArenaOutstanding++;
+    } else {
+        //remember how much space we needed for the next time the arena is reset
+        ctx->sliceArenaWanted = MAX(ctx->sliceArenaWanted, (ctx->sliceArena.size + needed) * 2);
+    }
+    pthread_mutex_unlock(&ctx->sliceArenaMutex);
+
+    return ret;
+}
+
+static void releaseSliceData(NVContext *ctx) {
+    pthread_mutex_lock(&ctx->sliceArenaMutex);
+    ctx->sliceArenaOutstanding--;
+    pthread_mutex_unlock(&ctx->sliceArenaMutex);
+}
+
+//Appends a slice (and optional header) to the current picture's bitstream, returning the offset of the start of it.
+//If the slice data was allocated from the arena and follows on from the previous slice the bitstream is built in place,
+//otherwise we fall back to copying everything into bitstreamBuffer.
+uint32_t appendSliceData(NVContext *ctx, NVBuffer *buf, uint32_t offset, uint32_t size, const uint8_t *header, uint32_t headerSize) {
+    if (!ctx->bitstreamCopied && buf->arenaContext == ctx && (headerSize == 0 || offset == 0)) {
+        //only write the header into the space reserved in front of the buffer, never over the buffer's own data
+        uint64_t pos = (uint64_t) ((uint8_t*) PTROFF(buf->ptr, offset) - (uint8_t*) ctx->sliceArena.buf) - headerSize;
+        if (ctx->bitstreamArenaSize == 0) {
+            ctx->bitstreamArenaBase = pos;
+        }
+        if (pos == ctx->bitstreamArenaBase + ctx->bitstreamArenaSize) {
+            if (headerSize > 0) {
+                memcpy(PTROFF(ctx->sliceArena.buf, pos), header, headerSize);
+            }
+            ctx->bitstreamArenaSize += headerSize + size;
+            return (uint32_t) (pos - ctx->bitstreamArenaBase);
+        }
+    }
+
+    if (!ctx->bitstreamCopied) {
+        ctx->bitstreamCopied = true;
+        ctx->bitstreamBuffer.size = 0;
+        if (ctx->bitstreamArenaSize > 0) {
+            //only NVDEC reads the bitstream from here on
+            void *dst = reserveBuffer(&ctx->bitstreamBuffer, ctx->bitstreamArenaSize);
+            if (dst == NULL) {
+                ctx->bitstreamFailed = true;
+                return 0;
+            }
+            fast_copy(dst, PTROFF(ctx->sliceArena.buf, ctx->bitstreamArenaBase), ctx->bitstreamArenaSize);
+            commitBuffer(&ctx->bitstreamBuffer, ctx->bitstreamArenaSize);
+        }
+    }
+
+    //write the header and slice in one go
+    uint32_t ret = (uint32_t) ctx->bitstreamBuffer.size;
+    uint8_t *dst = reserveBuffer(&ctx->bitstreamBuffer, headerSize + (uint64_t) size);
+    if (dst == NULL) {
+        ctx->bitstreamFailed = true;
+        return 0;
+    }
+    if (headerSize > 0) {
+        memcpy(dst, header, headerSize);
+    }
+    fast_copy(dst + headerSize, PTROFF(buf->ptr, offset), size);
+    commitBuffer(&ctx->bitstreamBuffer, headerSize + (uint64_t) size);
+    return ret;
+}
+
+//Sizes the bitstream and offset buffers up front for the slices in this render call, so appending them
+//doesn't have to grow the buffers part way through.
+static bool reserveSlices(NVContext *ctx, uint32_t sliceCount, uint64_t bytes, bool inArena) {
+    //AV1 stores a start and end offset for each slice
+    if (reserveBuffer(&ctx->sliceOffsets, sliceCount * 2 * sizeof(uint32_t)) == NULL) {
+        return false;
+    }
+
+    //the bitstream is only built in bitstreamBuffer if it can't be built in place in the arena
+    if (ctx->bitstreamCopied || !inArena) {
+        uint64_t headers = (uint64_t) sliceCount * ctx->codec->sliceDataHeaderSize;
+        uint64_t existing = ctx->bitstreamCopied ? 0 : ctx->bitstreamArenaSize;
+        if (reserveBuffer(&ctx->bitstreamBuffer, existing + bytes + headers) == NULL) {
+            return false;
+        }
+    }
+    return true;
+}
+
+//the object header and its payload are allocated together from a per-type slab
+#define OBJECT_HEADER_SIZE          ((sizeof(struct Object_t) + 15) & ~((size_t) 15))
+#define OBJECT_SLAB_CHUNK_BLOCKS    16
 
-    if (allocatePtrSize > 0) {
-        newObj->obj = calloc(1, allocatePtrSize);
+//upper limit on the amount of freed VABuffer memory kept around for reuse
+#define BUFFER_POOL_MAX_CACHED_BYTES    (64 * 1024 * 1024)
+
+static const size_t objectPayloadSize[OBJECT_TYPE_MAX] = {
+    [OBJECT_TYPE_CONFIG]  = sizeof(NVConfig),
+    [OBJECT_TYPE_CONTEXT] = sizeof(NVContext),
+    [OBJECT_TYPE_SURFACE] = sizeof(NVSurface),
+    [OBJECT_TYPE_BUFFER]  = sizeof(NVBuffer),
+    [OBJECT_TYPE_IMAGE]   = sizeof(NVImage),
+};
+
+static void initObjectSlabs(NVDriver *drv) {
+    for (int i = 0; i < OBJECT_TYPE_MAX; i++) {
+        init_slab(&drv->objectSlabs[i], OBJECT_HEADER_SIZE + objectPayloadSize[i], OBJECT_SLAB_CHUNK_BLOCKS);
     }
+}
 
+static void freeObjectSlabs(NVDriver *drv) {
     pthread_mutex_lock(&drv->objectCreationMutex);
-    add_element(&drv->objects, newObj);
+    for (int i = 0; i < OBJECT_TYPE_MAX; i++) {
+        if (drv->objectSlabs[i].liveCount > 0) {
+            LOG("Releasing %u leaked objects of type %d", drv->objectSlabs[i].liveCount, i);
+        }
+        free_slab(&drv->objectSlabs[i]);
+    }
+    free_handle_table(&drv->objects);
+    pthread_mutex_unlock(&drv->objectCreationMutex);
+}
+
+static Object allocateObject(NVDriver *drv, ObjectType type) {
+    pthread_mutex_lock(&drv->objectCreationMutex);
+    Object newObj = (Object) slab_alloc(&drv->objectSlabs[type]);
+    if (newObj == NULL) {
+        pthread_mutex_unlock(&drv->objectCreationMutex);
+        LOG("Unable to allocate object of type %d", type);
+        return NULL;
+    }
+
+    newObj->type = type;
+    newObj->obj = ((char*) newObj) + OBJECT_HEADER_SIZE;
+    newObj->id = add_handle(&drv->objects, newObj);
+    if (newObj->id == HANDLE_INVALID) {
+        //never hand the application an id of 0
+        LOG("Unable to allocate object handle, %u objects live", drv->objects.count);
+        slab_free(&drv->objectSlabs[type], newObj);
+        newObj = NULL;
+    }
     pthread_mutex_unlock(&drv->objectCreationMutex);
 
     return newObj;
@@ -224,14 +630,8 @@ static Object allocateObject(NVDriver *drv, ObjectType type, int allocatePtrSize
 static Object getObject(NVDriver *drv, VAGenericID id) {
     Object ret = NULL;
     if (id != VA_INVALID_ID) {
-        pthread_mutex_lock(&drv->objectCreationMutex);
-        ARRAY_FOR_EACH(Object, o, &drv->objects)
-            if (o->id == id) {
-                ret = o;
-                break;
-            }
-        END_FOR_EACH
-        pthread_mutex_unlock(&drv->objectCreationMutex);
+        //lookups are lock free, only creation and deletion take objectCreationMutex
+        ret = (Object) get_handle(&drv->objects, id);
     }
     return ret;
 }
@@ -246,56 +646,95 @@ static void* getObjectPtr(NVDriver *drv, VAGenericID id) {
     return NULL;
 }
 
-static Object getObjectByPtr(NVDriver *drv, void *ptr) {
-    Object ret = NULL;
-    if (ptr != NULL) {
-        pthread_mutex_lock(&drv->objectCreationMutex);
-        ARRAY_FOR_EACH(Object, o, &drv->objects)
-            if (o->obj == ptr) {
-                ret = o;
-                break;
-            }
-        END_FOR_EACH
-        pthread_mutex_unlock(&drv->objectCreationMutex);
-    }
-    return ret;
-}
-
 static void deleteObject(NVDriver *drv, VAGenericID id) {
     if (id == VA_INVALID_ID) {
         return;
     }
 
     pthread_mutex_lock(&drv->objectCreationMutex);
-    ARRAY_FOR_EACH(Object, o, &drv->objects)
-        if (o->id == id) {
-            remove_element_at(&drv->objects, o_idx);
-            if (o->obj != NULL) {
-                free(o->obj);
-            }
-            free(o);
-            //we've found the object, no need to continue
-            break;
-        }
-    END_FOR_EACH
+    Object o = (Object) remove_handle(&drv->objects, id);
+    if (o != NULL) {
+        slab_free(&drv->objectSlabs[o->type], o);
+    }
     pthread_mutex_unlock(&drv->objectCreationMutex);
 }
 
 static bool destroyContext(NVDriver *drv, NVContext *nvCtx) {
-    CHECK_CUDA_RESULT_RETURN(cu->cuCtxPushCurrent(drv->cudaContext), false);
-
-    LOG("Signaling resolve thread to exit");
-    struct timespec timeout;
-    clock_gettime(CLOCK_REALTIME, &timeout);
-    timeout.tv_sec += 5;
-    nvCtx->exiting = true;
-    pthread_cond_signal(&nvCtx->resolveCondition);
-    LOG("Waiting for resolve thread to exit");
-    int ret = pthread_timedjoin_np(nvCtx->resolveThread, NULL, &timeout);
-    LOG("pthread_timedjoin_np finished with %d", ret);
+    CHECK_CUDA_RESULT_RETURN(pushContext(drv->cudaContext), false);
+
+    //the submission thread feeds the resolve pool, so it has to finish first
+    if (nvCtx->asyncSubmit) {
+        LOG("Waiting for submission thread to exit");
+        pthread_mutex_lock(&nvCtx->submitMutex);
+        nvCtx->submitExiting = true;
+        pthread_cond_broadcast(&nvCtx->submitCondition);
+        pthread_mutex_unlock(&nvCtx->submitMutex);
+        pthread_join(nvCtx->submitThread, NULL);
+        nvCtx->asyncSubmit = false;
+    }
+
+    //anything already queued is still resolved, then the context is detached from the resolve pool
+    LOG("Waiting for resolve pool to finish with context");
+    spsc_queue_close(&nvCtx->surfaceQueue);
+    //a producer that got in before the close schedules the context before it lets go of the mutex
+    pthread_mutex_lock(&nvCtx->surfaceQueueMutex);
+    pthread_mutex_unlock(&nvCtx->surfaceQueueMutex);
+    //a worker always drains a closed queue before it lets go of the context, so this doesn't need a timeout, and the
+    //context must never be freed while it's still on a run list
+    pthread_mutex_lock(&drv->resolvePool.mutex);
+    while (nvCtx->scheduled) {
+        pthread_cond_wait(&drv->resolvePool.idleCondition, &drv->resolvePool.mutex);
+    }
+    //the workers are kept, they're idle until another context is created
+    drv->resolvePool.contexts--;
+    pthread_mutex_unlock(&drv->resolvePool.mutex);
+    LOG("Detached from resolve pool");
+    LOG("Resolve queue: depth %u, high water %u, %u producer stalls, %u hidden pictures or fields not resolved",
+        nvCtx->surfaceQueue.capacity, nvCtx->surfaceQueue.highWater, nvCtx->surfaceQueue.stalls, nvCtx->skippedResolves);
+    free_spsc_queue(&nvCtx->surfaceQueue);
+    if (nvCtx->stream != NULL) {
+        CHECK_CUDA_RESULT(cu->cuStreamDestroy(nvCtx->stream));
+        nvCtx->stream = NULL;
+    }
+
+    //deferred surfaces can't be resolved once the decoder is gone, and the surfaces are free to be used on another context
+    pthread_mutex_lock(&drv->objectCreationMutex);
+    HANDLE_TABLE_FOR_EACH(Object, o, &drv->objects)
+        if (o->type == OBJECT_TYPE_SURFACE && ((NVSurface*) o->obj)->context == nvCtx) {
+            NVSurface *surface = (NVSurface*) o->obj;
+            pthread_mutex_lock(&surface->mutex);
+            surface->resolvePending = false;
+            surface->context = NULL;
+            surface->pictureIdx = -1;
+            pthread_mutex_unlock(&surface->mutex);
+        }
+    END_FOR_EACH
+    pthread_mutex_unlock(&drv->objectCreationMutex);
+
+    //and a resolve request that found the context just before it was cleared has to be finished with it too
+    pthread_mutex_lock(&nvCtx->surfaceQueueMutex);
+    pthread_mutex_unlock(&nvCtx->surfaceQueueMutex);
 
     freeBuffer(&nvCtx->sliceOffsets);
     freeBuffer(&nvCtx->bitstreamBuffer);
+    for (int i = 0; i < SUBMIT_QUEUE_SIZE; i++) {
+        freeBuffer(&nvCtx->submitQueue[i].sliceOffsets);
+        freeBuffer(&nvCtx->submitQueue[i].bitstreamBuffer);
+    }
+
+    //any slice data buffers the application hasn't destroyed yet point into the arena, so detach them before freeing it
+    if (nvCtx->sliceArenaOutstanding > 0) {
+        pthread_mutex_lock(&drv->objectCreationMutex);
+        HANDLE_TABLE_FOR_EACH(Object, o, &drv->objects)
+            if (o->type == OBJECT_TYPE_BUFFER && ((NVBuffer*) o->obj)->arenaContext == nvCtx) {
+                ((NVBuffer*) o->obj)->arenaContext = NULL;
+                ((NVBuffer*) o->obj)->ptr = NULL;
+            }
+        END_FOR_EACH
+        pthread_mutex_unlock(&drv->objectCreationMutex);
+        nvCtx->sliceArenaOutstanding = 0;
+    }
+    freeBuffer(&nvCtx->sliceArena);
 
     bool successful = true;
     if (nvCtx->decoder != NULL) {
@@ -306,20 +745,33 @@ static bool destroyContext(NVDriver *drv, NVContext *nvCtx) {
       }
     }
     nvCtx->decoder = NULL;
-    CHECK_CUDA_RESULT_RETURN(cu->cuCtxPopCurrent(NULL), false);
+    //the lock goes after the decoder that uses it
+    if (nvCtx->vidLock != NULL) {
+        CHECK_CUDA_RESULT(cv->cuvidCtxLockDestroy(nvCtx->vidLock));
+        nvCtx->vidLock = NULL;
+    }
+    CHECK_CUDA_RESULT_RETURN(popContext(), false);
 
     return successful;
 }
 
 static void deleteAllObjects(NVDriver *drv) {
     pthread_mutex_lock(&drv->objectCreationMutex);
-    ARRAY_FOR_EACH(Object, o, &drv->objects)
+    HANDLE_TABLE_FOR_EACH(Object, o, &drv->objects)
         LOG("Found object %d or type %d", o->id, o->type);
         if (o->type == OBJECT_TYPE_CONTEXT) {
             destroyContext(drv, (NVContext*) o->obj);
             deleteObject(drv, o->id);
         }
     END_FOR_EACH
+    //the slabs are freed without looking inside the objects, so leaked surfaces' events have to go now the contexts
+    //(and the resolve pool) are done with them, the caller has the CUDA context pushed if any were created
+    HANDLE_TABLE_FOR_EACH(Object, o, &drv->objects)
+        if (o->type == OBJECT_TYPE_SURFACE && ((NVSurface*) o->obj)->copyEvent != NULL) {
+            CHECK_CUDA_RESULT(cu->cuEventDestroy(((NVSurface*) o->obj)->copyEvent));
+            ((NVSurface*) o->obj)->copyEvent = NULL;
+        }
+    END_FOR_EACH
     pthread_mutex_unlock(&drv->objectCreationMutex);
 }
 
@@ -340,207 +792,770 @@ int pictureIdxFromSurfaceId(NVDriver *drv, VASurfaceID surfId) {
     return -1;
 }
 
-static cudaVideoCodec vaToCuCodec(VAProfile profile) {
+//profile lookups, built from the codec section the first time they're needed
+#define MAX_VA_PROFILE 64
+static pthread_once_t profileLookupOnce = PTHREAD_ONCE_INIT;
+static cudaVideoCodec profileCudaCodecs[MAX_VA_PROFILE];
+static const NVCodec *profileCodecs[MAX_VA_PROFILE];
+
+static void buildProfileLookup(void) {
+    for (int profile = 0; profile < MAX_VA_PROFILE; profile++) {
+        profileCudaCodecs[profile] = cudaVideoCodec_NONE;
+        for (const NVCodec *c = __start_nvd_codecs; c < __stop_nvd_codecs; c++) {
+            cudaVideoCodec cvc = c->computeCudaCodec(profile);
+            if (cvc != cudaVideoCodec_NONE) {
+                profileCudaCodecs[profile] = cvc;
+                break;
+            }
+        }
+    }
+
     for (const NVCodec *c = __start_nvd_codecs; c < __stop_nvd_codecs; c++) {
-        cudaVideoCodec cvc = c->computeCudaCodec(profile);
-        if (cvc != cudaVideoCodec_NONE) {
-            return cvc;
+        for (int i = 0; i < c->supportedProfileCount; i++) {
+            VAProfile profile = c->supportedProfiles[i];
+            if (profile >= 0 && profile < MAX_VA_PROFILE) {
+                profileCodecs[profile] = c;
+            }
         }
     }
+}
 
-    return cudaVideoCodec_NONE;
+static cudaVideoCodec vaToCuCodec(VAProfile profile) {
+    if (profile < 0 || profile >= MAX_VA_PROFILE) {
+        return cudaVideoCodec_NONE;
+    }
+    pthread_once(&profileLookupOnce, buildProfileLookup);
+    return profileCudaCodecs[profile];
 }
 
-static bool doesGPUSupportCodec(cudaVideoCodec codec, int bitDepth, cudaVideoChromaFormat chromaFormat, uint32_t *width, uint32_t *height)
-{
-    CUVIDDECODECAPS videoDecodeCaps = {
-        .eCodecType      = codec,
-        .eChromaFormat   = chromaFormat,
-        .nBitDepthMinus8 = bitDepth - 8
-    };
+static const NVCodec *codecForProfile(VAProfile profile) {
+    if (profile < 0 || profile >= MAX_VA_PROFILE) {
+        return NULL;
+    }
+    pthread_once(&profileLookupOnce, buildProfileLookup);
+    return profileCodecs[profile];
+}
+
+static bool initGpu(NVDriver *drv);
+
+//fills in what NVDEC supports for the combination, asking it the first time, returns false if it couldn't be asked
+//the table can be reloaded when the GPU is initialised, so callers get a copy rather than a pointer into it
+static bool getCodecCaps(NVDriver *drv, cudaVideoCodec codec, int bitDepth, cudaVideoChromaFormat chromaFormat, CodecCaps *out) {
+    pthread_mutex_lock(&drv->capsMutex);
+    CodecCaps *caps = caps_table_entry(&drv->caps, codec, chromaFormat, bitDepth);
+    bool probed = caps == NULL || caps->probed;
+    if (caps != NULL && probed) {
+        *out = *caps;
+    }
+    pthread_mutex_unlock(&drv->capsMutex);
+    if (probed) {
+        return caps != NULL;
+    }
+
+    //it's not in the cache, so we need the GPU after all
+    if (!initGpu(drv)) {
+        return false;
+    }
+
+    pthread_mutex_lock(&drv->capsMutex);
+    caps = caps_table_entry(&drv->caps, codec, chromaFormat, bitDepth);
+    if (!caps->probed) {
+        CUVIDDECODECAPS videoDecodeCaps = {
+            .eCodecType      = codec,
+            .eChromaFormat   = chromaFormat,
+            .nBitDepthMinus8 = bitDepth - 8
+        };
+
+        if (CHECK_CUDA_RESULT(pushContext(drv->cudaContext))) {
+            caps = NULL;
+        } else {
+            if (CHECK_CUDA_RESULT(cv->cuvidGetDecoderCaps(&videoDecodeCaps))) {
+                caps = NULL;
+            } else {
+                caps->probed = 1;
+                caps->supported = videoDecodeCaps.bIsSupported == 1;
+                caps->minWidth = videoDecodeCaps.nMinWidth;
+                caps->minHeight = videoDecodeCaps.nMinHeight;
+                caps->maxWidth = videoDecodeCaps.nMaxWidth;
+                caps->maxHeight = videoDecodeCaps.nMaxHeight;
+                caps->maxMBCount = videoDecodeCaps.nMaxMBCount;
+                drv->capsDirty = true;
+            }
+            CHECK_CUDA_RESULT(popContext());
+        }
+    }
+    if (caps != NULL) {
+        *out = *caps;
+    }
+    pthread_mutex_unlock(&drv->capsMutex);
+    return caps != NULL;
+}
+
+//writes out any caps we've had to ask NVDEC for since the cache was last loaded or saved
+static void saveCodecCaps(NVDriver *drv) {
+    pthread_mutex_lock(&drv->capsMutex);
+    if (drv->capsDirty && drv->capsKey[0] != '\0') {
+        if (!caps_cache_save(&drv->caps, drv->capsKey)) {
+            LOG("Unable to save decoder caps cache");
+        }
+        drv->capsDirty = false;
+    }
+    pthread_mutex_unlock(&drv->capsMutex);
+}
+
+//switches the caps table over to the given GPU, loading what we know about it from the cache
+//returns true if the cache file had everything needed to answer queries without the GPU
+static bool loadCodecCaps(NVDriver *drv, const uint8_t uuid[CAPS_UUID_SIZE]) {
+    char key[sizeof(drv->capsKey)];
+    if (!capsCache || !caps_cache_make_key(key, sizeof(key), uuid, backend == DIRECT ? "-direct" : "-egl")) {
+        key[0] = '\0';
+    }
 
-    CHECK_CUDA_RESULT_RETURN(cv->cuvidGetDecoderCaps(&videoDecodeCaps), false);
+    pthread_mutex_lock(&drv->capsMutex);
+    bool loaded = false;
+    if (strcmp(key, drv->capsKey) != 0 || key[0] == '\0') {
+        memset(&drv->caps, 0, sizeof(drv->caps));
+        drv->capsDirty = false;
+        snprintf(drv->capsKey, sizeof(drv->capsKey), "%s", key);
+        if (key[0] != '\0' && caps_cache_load(&drv->caps, key)) {
+            LOG("Loaded decoder caps from cache (%s)", key);
+        }
+    }
+    loaded = drv->caps.surfaceFormatsProbed;
+    if (loaded) {
+        drv->supports16BitSurface = drv->caps.supports16BitSurface;
+        drv->supports444Surface = drv->caps.supports444Surface;
+    }
+    pthread_mutex_unlock(&drv->capsMutex);
+    return loaded;
+}
+
+static bool doesGPUSupportCodec(NVDriver *drv, cudaVideoCodec codec, int bitDepth, cudaVideoChromaFormat chromaFormat, uint32_t *width, uint32_t *height)
+{
+    CodecCaps caps;
+    if (!getCodecCaps(drv, codec, bitDepth, chromaFormat, &caps)) {
+        return false;
+    }
 
     if (width != NULL) {
-        *width = videoDecodeCaps.nMaxWidth;
+        *width = caps.maxWidth;
     }
     if (height != NULL) {
-        *height = videoDecodeCaps.nMaxHeight;
+        *height = caps.maxHeight;
     }
-    return (videoDecodeCaps.bIsSupported == 1);
+    return caps.supported;
 }
 
-static void* resolveSurfaces(void *param) {
-    NVContext *ctx = (NVContext*) param;
+static void failSurface(NVSurface *surface) {
+    pthread_mutex_lock(&surface->mutex);
+    surface->decodeFailed = true;
+    surface->resolving = 0;
+    pthread_cond_broadcast(&surface->cond);
+    pthread_mutex_unlock(&surface->mutex);
+}
+
+//notify everyone waiting for us to be resolved, there can be more than one thread syncing on a surface
+static void markSurfaceResolved(NVSurface *surface) {
+    pthread_mutex_lock(&surface->mutex);
+    surface->resolving = 0;
+    pthread_cond_broadcast(&surface->cond);
+    pthread_mutex_unlock(&surface->mutex);
+}
+
+//converts a relative timeout into an absolute CLOCK_MONOTONIC deadline, returns NULL for an infinite timeout
+static struct timespec *timeoutToDeadline(uint64_t timeout_ns, struct timespec *deadline) {
+    if (timeout_ns == UINT64_MAX) {
+        return NULL;
+    }
+    clock_gettime(CLOCK_MONOTONIC, deadline);
+    //clamp it so we don't overflow time_t with an absurd (but not infinite) timeout
+    uint64_t nsec = deadline->tv_nsec + MIN(timeout_ns, (uint64_t) 365 * 24 * 3600 * 1000000000ull);
+    deadline->tv_sec += nsec / 1000000000ull;
+    deadline->tv_nsec = nsec % 1000000000ull;
+    return deadline;
+}
+
+//the surface has been decoded, but it won't be copied into its backing image until something asks for its contents
+static void deferSurfaceResolve(NVSurface *surface) {
+    pthread_mutex_lock(&surface->mutex);
+    surface->resolvePending = true;
+    surface->resolving = 0;
+    pthread_cond_broadcast(&surface->cond);
+    pthread_mutex_unlock(&surface->mutex);
+}
+
+//blocks until the resolve pool has finished with the surface, or the deadline (if any) passes
+static VAStatus waitForSurfaceResolved(NVSurface *surface, const struct timespec *deadline) {
+    VAStatus ret = VA_STATUS_SUCCESS;
+
+    pthread_mutex_lock(&surface->mutex);
+    if (surface->resolving) {
+        LOG("Surface %d not resolved, waiting", surface->pictureIdx);
+    }
+    //loop as the wait can wake spuriously
+    while (surface->resolving) {
+        if (deadline == NULL) {
+            pthread_cond_wait(&surface->cond, &surface->mutex);
+        } else if (pthread_cond_timedwait(&surface->cond, &surface->mutex, deadline) == ETIMEDOUT) {
+            LOG("Timed out waiting for surface %d", surface->pictureIdx);
+            ret = VA_STATUS_ERROR_TIMEDOUT;
+            break;
+        }
+    }
+    if (ret == VA_STATUS_SUCCESS && surface->decodeFailed) {
+        ret = VA_STATUS_ERROR_DECODING_ERROR;
+    }
+    pthread_mutex_unlock(&surface->mutex);
+
+    return ret;
+}
+
+//blocks until the surface isn't waiting to be submitted, queued for the resolve pool or mapped by it
+static void waitForSurfaceIdle(NVSurface *surface) {
+    waitForSurfaceResolved(surface, NULL);
+    pthread_mutex_lock(&surface->mutex);
+    while (surface->mappedFrames > 0) {
+        pthread_cond_wait(&surface->cond, &surface->mutex);
+    }
+    pthread_mutex_unlock(&surface->mutex);
+}
+
+//waits for the copy into the backing image queued by the resolve pool to finish
+static VAStatus waitForSurfaceCopy(NVDriver *drv, NVSurface *surface, const struct timespec *deadline) {
+    if (surface->copyEvent == NULL) {
+        return VA_STATUS_SUCCESS;
+    }
+
+    CHECK_CUDA_RESULT_RETURN(pushContext(drv->cudaContext), VA_STATUS_ERROR_OPERATION_FAILED);
+    CUresult result;
+    if (deadline == NULL) {
+        result = cu->cuEventSynchronize(surface->copyEvent);
+    } else {
+        //there's no timed event wait, but the copy is short so polling it is cheap
+        struct timespec now;
+        while ((result = cu->cuEventQuery(surface->copyEvent)) == CUDA_ERROR_NOT_READY) {
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            if (now.tv_sec > deadline->tv_sec || (now.tv_sec == deadline->tv_sec && now.tv_nsec >= deadline->tv_nsec)) {
+                break;
+            }
+            nanosleep(&(struct timespec) { .tv_nsec = 100000 }, NULL);
+        }
+    }
+    CHECK_CUDA_RESULT_RETURN(popContext(), VA_STATUS_ERROR_OPERATION_FAILED);
+
+    if (result == CUDA_ERROR_NOT_READY) {
+        LOG("Timed out waiting for surface %d to be copied", surface->pictureIdx);
+        return VA_STATUS_ERROR_TIMEDOUT;
+    }
+    return CHECK_CUDA_RESULT(result) ? VA_STATUS_ERROR_DECODING_ERROR : VA_STATUS_SUCCESS;
+}
+
+static void unmapFrame(NVContext *ctx, MappedFrame *frame) {
+    if (frame->copyEvent != NULL) {
+        CHECK_CUDA_RESULT(cu->cuEventSynchronize(frame->copyEvent));
+    }
+    CHECK_CUDA_RESULT(cv->cuvidUnmapVideoFrame(ctx->decoder, frame->deviceMemory));
+
+    if (frame->copyEvent != NULL) {
+        pthread_mutex_lock(&frame->surface->mutex);
+        frame->surface->mappedFrames--;
+        pthread_cond_broadcast(&frame->surface->cond);
+        pthread_mutex_unlock(&frame->surface->mutex);
+    }
+}
+
+static void unmapAllFrames(NVContext *ctx) {
+    for (; ctx->mappedCount > 0; ctx->mappedCount--, ctx->mappedHead = (ctx->mappedHead + 1) % MAX_OUTPUT_SURFACES) {
+        unmapFrame(ctx, &ctx->mapped[ctx->mappedHead]);
+    }
+}
+
+static void resolveSurface(NVContext *ctx, NVSurface *surface) {
     NVDriver *drv = ctx->drv;
-    CHECK_CUDA_RESULT_RETURN(cu->cuCtxPushCurrent(drv->cudaContext), NULL);
-
-    LOG("[RT] Resolve thread for %p started", ctx);
-    while (!ctx->exiting) {
-        //wait for frame on queue
-        pthread_mutex_lock(&ctx->resolveMutex);
-        while (ctx->surfaceQueueReadIdx == ctx->surfaceQueueWriteIdx) {
-            pthread_cond_wait(&ctx->resolveCondition, &ctx->resolveMutex);
-            if (ctx->exiting) {
-                pthread_mutex_unlock(&ctx->resolveMutex);
-                goto out;
+
+    //NVDEC only gives us numOutputSurfaces mappings, so release the oldest one if we need to
+    //frames stay mapped after they've been copied, so copying one frame can overlap mapping (and post-processing) the next
+    if (ctx->mappedCount == ctx->numOutputSurfaces) {
+        unmapFrame(ctx, &ctx->mapped[ctx->mappedHead]);
+        ctx->mappedHead = (ctx->mappedHead + 1) % MAX_OUTPUT_SURFACES;
+        ctx->mappedCount--;
+    }
+
+    CUdeviceptr deviceMemory = (CUdeviceptr) NULL;
+    unsigned int pitch = 0;
+
+    //map frame
+    CUVIDPROCPARAMS procParams = {
+        .progressive_frame = surface->progressiveFrame,
+        .top_field_first = surface->topFieldFirst,
+        .second_field = surface->secondField,
+        .output_stream = ctx->stream
+    };
+
+    LOG("Mapping surface %d", surface->pictureIdx);
+    if (CHECK_CUDA_RESULT(cv->cuvidMapVideoFrame(ctx->decoder, surface->pictureIdx, &deviceMemory, &pitch, &procParams))) {
+        failSurface(surface);
+        return;
+    }
+    LOG("Mapped surface %d to %llX (%d)", surface->pictureIdx, deviceMemory, pitch);
+
+    //update cuarray, the copy is only queued here, anyone that needs the result waits on the surface's event
+    CUevent copyEvent = NULL;
+    if (drv->backend->exportCudaPtr(drv, deviceMemory, surface, pitch, ctx->stream)
+            && !CHECK_CUDA_RESULT(cu->cuEventRecord(surface->copyEvent, ctx->stream))) {
+        LOG("Surface %d exported", surface->pictureIdx);
+        copyEvent = surface->copyEvent;
+        //counted before it's marked resolved, so nvDestroySurfaces can't miss the mapping
+        pthread_mutex_lock(&surface->mutex);
+        surface->mappedFrames++;
+        pthread_mutex_unlock(&surface->mutex);
+        markSurfaceResolved(surface);
+    } else {
+        //we don't know how much of the copy was queued, so wait for all of it before unmapping
+        CHECK_CUDA_RESULT(cu->cuStreamSynchronize(ctx->stream));
+        failSurface(surface);
+    }
+
+    ctx->mapped[(ctx->mappedHead + ctx->mappedCount) % MAX_OUTPUT_SURFACES] = (MappedFrame) {
+        .surface = surface,
+        .deviceMemory = deviceMemory,
+        .copyEvent = copyEvent
+    };
+    ctx->mappedCount++;
+}
+
+//must be called with the pool mutex held
+static void appendRunnableContext(ResolvePool *pool, NVContext *ctx) {
+    int home = ctx->homeWorker;
+    NVPriority priority = ctx->priority;
+    ctx->runNext = NULL;
+    if (pool->runTail[home][priority] == NULL) {
+        pool->runHead[home][priority] = ctx;
+    } else {
+        pool->runTail[home][priority]->runNext = ctx;
+    }
+    pool->runTail[home][priority] = ctx;
+    pthread_cond_signal(&pool->cond);
+}
+
+static NVContext *popRunnableContext(ResolvePool *pool, int worker, NVPriority priority) {
+    NVContext *ctx = pool->runHead[worker][priority];
+    if (ctx != NULL) {
+        pool->runHead[worker][priority] = ctx->runNext;
+        if (pool->runHead[worker][priority] == NULL) {
+            pool->runTail[worker][priority] = NULL;
+        }
+        ctx->runNext = NULL;
+    }
+    return ctx;
+}
+
+//must be called with the pool mutex held, prefers the worker's own contexts but steals from the others if it has none
+//at the same priority, a lower priority context is only taken if there are no higher priority ones anywhere
+static NVContext *takeRunnableContext(ResolvePool *pool, int worker) {
+    for (int priority = NV_PRIORITY_LEVELS - 1; priority >= 0; priority--) {
+        NVContext *ctx = popRunnableContext(pool, worker, priority);
+        for (int i = 1; ctx == NULL && i < pool->threadCount; i++) {
+            ctx = popRunnableContext(pool, (worker + i) % pool->threadCount, priority);
+            if (ctx != NULL) {
+                pool->steals++;
             }
         }
-        pthread_mutex_unlock(&ctx->resolveMutex);
-        //find the last item
-        LOG("Reading from queue: %d %d", ctx->surfaceQueueReadIdx, ctx->surfaceQueueWriteIdx);
-        NVSurface *surface = ctx->surfaceQueue[ctx->surfaceQueueReadIdx++];
-        if (ctx->surfaceQueueReadIdx >= SURFACE_QUEUE_SIZE) {
-            ctx->surfaceQueueReadIdx = 0;
+        if (ctx != NULL) {
+            return ctx;
         }
+    }
+    return NULL;
+}
 
-        CUdeviceptr deviceMemory = (CUdeviceptr) NULL;
-        unsigned int pitch = 0;
+//keeps the calling thread on the CPUs closest to the GPU
+static void applyThreadPlacement(NVDriver *drv) {
+    if (drv->hasNumaCpus) {
+        int err = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &drv->numaCpus);
+        if (err != 0) {
+            LOG("Unable to set thread affinity: %d", err);
+        }
+    }
+}
 
-        //map frame
-        CUVIDPROCPARAMS procParams = {
-            .progressive_frame = surface->progressiveFrame,
-            .top_field_first = surface->topFieldFirst,
-            .second_field = surface->secondField
-        };
+static void* resolveWorker(void *param) {
+    ResolveWorker *worker = (ResolveWorker*) param;
+    NVDriver *drv = worker->drv;
+    ResolvePool *pool = &drv->resolvePool;
+
+    applyThreadPlacement(drv);
 
-        LOG("Mapping surface %d", surface->pictureIdx);
-        if (CHECK_CUDA_RESULT(cv->cuvidMapVideoFrame(ctx->decoder, surface->pictureIdx, &deviceMemory, &pitch, &procParams))) {
+    //every context on this driver shares the same CUDA context, so it only has to be made current once
+    CHECK_CUDA_RESULT_RETURN(pushContext(drv->cudaContext), NULL);
+
+    LOG("[RT] Resolve worker %d started", worker->idx);
+    pthread_mutex_lock(&pool->mutex);
+    while (true) {
+        NVContext *ctx = takeRunnableContext(pool, worker->idx);
+        if (ctx == NULL) {
+            if (pool->exiting) {
+                break;
+            }
+            pthread_cond_wait(&pool->cond, &pool->mutex);
             continue;
         }
-        LOG("Mapped surface %d to %llX (%d)", surface->pictureIdx, deviceMemory, pitch);
+        pthread_mutex_unlock(&pool->mutex);
 
-        //update cuarray
-        drv->backend->exportCudaPtr(drv, deviceMemory, surface, pitch);
-        LOG("Surface %d exported", surface->pictureIdx);
-        //unmap frame
-        CHECK_CUDA_RESULT(cv->cuvidUnmapVideoFrame(ctx->decoder, deviceMemory));
+        //only one worker owns a context at a time, so its surfaces are still resolved in the order they were decoded
+        NVSurface *surface;
+        for (int i = 0; i < RESOLVE_BATCH_SIZE && spsc_queue_try_pop(&ctx->surfaceQueue, (void**) &surface); i++) {
+            resolveSurface(ctx, surface);
+        }
+
+        //if there's nothing waiting, release all the mappings so NVDEC can reuse them
+        if (spsc_queue_size(&ctx->surfaceQueue) == 0) {
+            unmapAllFrames(ctx);
+        }
+
+        pthread_mutex_lock(&pool->mutex);
+        //this has to be checked with the mutex held, otherwise we could miss a surface queued after the check
+        if (spsc_queue_size(&ctx->surfaceQueue) > 0) {
+            //go to the back of the line so other contexts get a turn
+            appendRunnableContext(pool, ctx);
+        } else {
+            ctx->scheduled = false;
+            pthread_cond_broadcast(&pool->idleCondition);
+        }
     }
-out:
-    LOG("[RT] Resolve thread for %p exiting", ctx);
+    pthread_mutex_unlock(&pool->mutex);
+
+    CHECK_CUDA_RESULT(popContext());
+    LOG("[RT] Resolve worker %d exiting", worker->idx);
     return NULL;
 }
 
+static void initResolvePool(NVDriver *drv) {
+    ResolvePool *pool = &drv->resolvePool;
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->cond, NULL);
+    pthread_cond_init(&pool->idleCondition, NULL);
+}
+
+//the workers are only started when the first context is created, so processes that just query the driver don't pay for them
+//a worker blocks while NVDEC maps a frame and while it waits for the copy out of it, so unless the size has been set the
+//pool grows to at least one worker per context, otherwise one stalled decoder would hold up all the others
+static bool attachToResolvePool(NVDriver *drv, NVContext *ctx) {
+    ResolvePool *pool = &drv->resolvePool;
+    bool ret = true;
+
+    pthread_mutex_lock(&pool->mutex);
+    if (pool->baseThreadCount == 0) {
+        int count = resolveThreads;
+        if (count <= 0) {
+            //copies are issued on the GPU's copy engines, so there's no point having more workers than those (or cores)
+            int copyEngines = 1;
+            CUdevice device;
+            if (pushContext(drv->cudaContext) == CUDA_SUCCESS) {
+                if (cu->cuCtxGetDevice(&device) == CUDA_SUCCESS) {
+                    CHECK_CUDA_RESULT(cu->cuDeviceGetAttribute(&copyEngines, CU_DEVICE_ATTRIBUTE_ASYNC_ENGINE_COUNT, device));
+                }
+                popContext();
+            }
+            count = MIN(MAX(copyEngines, 1), (int) sysconf(_SC_NPROCESSORS_ONLN));
+        }
+        pool->baseThreadCount = MIN(MAX(count, 1), MAX_RESOLVE_THREADS);
+    }
+
+    pool->contexts++;
+    int count = pool->baseThreadCount;
+    if (resolveThreads <= 0) {
+        count = MIN(MAX(count, pool->contexts), MAX_RESOLVE_THREADS);
+    }
+    if (pool->threadCount < count) {
+        for (int i = pool->threadCount; i < count; i++) {
+            pool->workers[i].drv = drv;
+            pool->workers[i].idx = i;
+            //the worker looks at threadCount, so it has to be updated before the thread starts
+            pool->threadCount++;
+            int err = pthread_create(&pool->workers[i].thread, NULL, &resolveWorker, &pool->workers[i]);
+            if (err != 0) {
+                LOG("Unable to create resolve worker: %d", err);
+                pool->threadCount--;
+                break;
+            }
+        }
+        LOG("Resolve pool has %d workers for %d contexts", pool->threadCount, pool->contexts);
+    }
+    //spread the contexts between the workers, idle workers will steal them anyway if this one is busy
+    ret = pool->threadCount > 0;
+    if (ret) {
+        ctx->homeWorker = pool->nextHome++ % pool->threadCount;
+    } else {
+        pool->contexts--;
+    }
+    pthread_mutex_unlock(&pool->mutex);
 
-#define MAX_PROFILES 32
-static VAStatus nvQueryConfigProfiles(
-        VADriverContextP ctx,
-        VAProfile *profile_list,	/* out */
-        int *num_profiles			/* out */
-    )
-{
-    NVDriver *drv = (NVDriver*) ctx->pDriverData;
-    CHECK_CUDA_RESULT_RETURN(cu->cuCtxPushCurrent(drv->cudaContext), VA_STATUS_ERROR_OPERATION_FAILED);
+    return ret;
+}
 
-    int profiles = 0;
-    if (doesGPUSupportCodec(cudaVideoCodec_MPEG2, 8, cudaVideoChromaFormat_420, NULL, NULL)) {
-        profile_list[profiles++] = VAProfileMPEG2Simple;
-        profile_list[profiles++] = VAProfileMPEG2Main;
-    }
-    if (doesGPUSupportCodec(cudaVideoCodec_MPEG4, 8, cudaVideoChromaFormat_420, NULL, NULL)) {
-        profile_list[profiles++] = VAProfileMPEG4Simple;
-        profile_list[profiles++] = VAProfileMPEG4AdvancedSimple;
-        profile_list[profiles++] = VAProfileMPEG4Main;
+static void stopResolvePool(NVDriver *drv) {
+    ResolvePool *pool = &drv->resolvePool;
+
+    pthread_mutex_lock(&pool->mutex);
+    pool->exiting = true;
+    pthread_cond_broadcast(&pool->cond);
+    int count = pool->threadCount;
+    pthread_mutex_unlock(&pool->mutex);
+
+    for (int i = 0; i < count; i++) {
+        pthread_join(pool->workers[i].thread, NULL);
     }
-    if (doesGPUSupportCodec(cudaVideoCodec_VC1, 8, cudaVideoChromaFormat_420, NULL, NULL)) {
-        profile_list[profiles++] = VAProfileVC1Simple;
-        profile_list[profiles++] = VAProfileVC1Main;
-        profile_list[profiles++] = VAProfileVC1Advanced;
+    LOG("Resolve pool: %d workers, %u steals", count, pool->steals);
+
+    pool->threadCount = 0;
+    pool->baseThreadCount = 0;
+    pool->exiting = false;
+}
+
+//assigns the context to a worker, and hands it over if it isn't already waiting for (or being processed by) one
+static void scheduleContext(NVContext *ctx) {
+    ResolvePool *pool = &ctx->drv->resolvePool;
+
+    pthread_mutex_lock(&pool->mutex);
+    if (!ctx->scheduled) {
+        ctx->scheduled = true;
+        appendRunnableContext(pool, ctx);
     }
-    if (doesGPUSupportCodec(cudaVideoCodec_H264, 8, cudaVideoChromaFormat_420, NULL, NULL)) {
-        profile_list[profiles++] = VAProfileH264Baseline;
-        profile_list[profiles++] = VAProfileH264Main;
-        profile_list[profiles++] = VAProfileH264High;
-        profile_list[profiles++] = VAProfileH264ConstrainedBaseline;
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+//must be called with surfaceQueueMutex held, the context is scheduled before it's released so destroyContext
+//can't miss a surface that was pushed just before the queue was closed
+static bool queueSurfaceLocked(NVContext *ctx, NVSurface *surface) {
+    //this will block if the resolve pool has fallen too far behind
+    if (!spsc_queue_push(&ctx->surfaceQueue, surface)) {
+        LOG("Resolve queue closed, dropping surface %d", surface->pictureIdx);
+        return false;
     }
-    if (doesGPUSupportCodec(cudaVideoCodec_JPEG, 8, cudaVideoChromaFormat_420, NULL, NULL)) {
-        profile_list[profiles++] = VAProfileJPEGBaseline;
+    scheduleContext(ctx);
+    return true;
+}
+
+static void queueSurfaceForResolve(NVContext *ctx, NVSurface *surface) {
+    pthread_mutex_lock(&ctx->surfaceQueueMutex);
+    bool queued = queueSurfaceLocked(ctx, surface);
+    pthread_mutex_unlock(&ctx->surfaceQueueMutex);
+    if (!queued) {
+        failSurface(surface);
     }
-    if (doesGPUSupportCodec(cudaVideoCodec_H264_SVC, 8, cudaVideoChromaFormat_420, NULL, NULL)) {
-        profile_list[profiles++] = VAProfileH264StereoHigh;
+}
+
+//queues a deferred surface for resolving, once it's been resolved it's waited on like any other surface
+static void requestSurfaceResolve(NVSurface *surface) {
+    pthread_mutex_lock(&surface->mutex);
+    NVContext *ctx = (NVContext*) surface->context;
+    bool pending = surface->resolvePending && ctx != NULL;
+    if (pending) {
+        surface->resolvePending = false;
+        surface->resolving = 1;
+        //destroyContext clears surface->context before freeing the context, so taking the queue mutex before
+        //letting go of the surface keeps the context alive until we're done with it
+        pthread_mutex_lock(&ctx->surfaceQueueMutex);
     }
-    if (doesGPUSupportCodec(cudaVideoCodec_H264_MVC, 8, cudaVideoChromaFormat_420, NULL, NULL)) {
-        profile_list[profiles++] = VAProfileH264MultiviewHigh;
+    pthread_mutex_unlock(&surface->mutex);
+
+    if (pending) {
+        LOG("Resolving surface %d on demand", surface->pictureIdx);
+        bool queued = queueSurfaceLocked(ctx, surface);
+        pthread_mutex_unlock(&ctx->surfaceQueueMutex);
+        if (!queued) {
+            failSurface(surface);
+        }
     }
-    if (doesGPUSupportCodec(cudaVideoCodec_HEVC, 8, cudaVideoChromaFormat_420, NULL, NULL)) {
-        profile_list[profiles++] = VAProfileHEVCMain;
+}
+
+//deferResolve is set for pictures that won't be displayed (or aren't in lazy mode), so they aren't copied unless asked for
+static bool submitPicture(NVContext *ctx, CUVIDPICPARAMS *picParams, NVSurface *surface, bool deferResolve) {
+    CUresult result = cv->cuvidDecodePicture(ctx->decoder, picParams);
+    if (result != CUDA_SUCCESS) {
+        LOG("cuvidDecodePicture failed: %d", result);
+        failSurface(surface);
+        return false;
     }
-    if (doesGPUSupportCodec(cudaVideoCodec_VP8, 8, cudaVideoChromaFormat_420, NULL, NULL)) {
-        profile_list[profiles++] = VAProfileVP8Version0_3;
+    LOG("Decoded frame successfully to idx: %d (%p)", picParams->CurrPicIdx, surface);
+
+    if (deferResolve) {
+        deferSurfaceResolve(surface);
+    } else {
+        queueSurfaceForResolve(ctx, surface);
     }
-    if (doesGPUSupportCodec(cudaVideoCodec_VP9, 8, cudaVideoChromaFormat_420, NULL, NULL)) {
-        profile_list[profiles++] = VAProfileVP9Profile0; //color depth: 8 bit, 4:2:0
+    return true;
+}
+
+//takes a copy of the picture parameters, and ownership of the bitstream, so the context can start on the next picture
+static void queueSubmission(NVContext *ctx, CUVIDPICPARAMS *picParams, NVSurface *surface, bool inArena, bool deferResolve) {
+    pthread_mutex_lock(&ctx->submitMutex);
+    while (ctx->submitQueueCount == SUBMIT_QUEUE_SIZE) {
+        pthread_cond_wait(&ctx->submitCondition, &ctx->submitMutex);
     }
-    if (doesGPUSupportCodec(cudaVideoCodec_AV1, 8, cudaVideoChromaFormat_420, NULL, NULL)) {
-        profile_list[profiles++] = VAProfileAV1Profile0;
+
+    NVSubmitJob *job = &ctx->submitQueue[(ctx->submitQueueReadIdx + ctx->submitQueueCount) % SUBMIT_QUEUE_SIZE];
+    job->picParams = *picParams;
+    job->surface = surface;
+    job->usesArena = inArena;
+    job->deferResolve = deferResolve;
+
+    if (inArena) {
+        //hold a reference on the arena so it isn't reset underneath the submission thread
+        pthread_mutex_lock(&ctx->sliceArenaMutex);
+        ctx->sliceArenaOutstanding++;
+        pthread_mutex_unlock(&ctx->sliceArenaMutex);
+    } else {
+        AppendableBuffer tmp = job->bitstreamBuffer;
+        job->bitstreamBuffer = ctx->bitstreamBuffer;
+        ctx->bitstreamBuffer = tmp;
+        job->picParams.pBitstreamData = job->bitstreamBuffer.buf;
     }
 
-    if (drv->supports16BitSurface) {
-        if (doesGPUSupportCodec(cudaVideoCodec_HEVC, 10, cudaVideoChromaFormat_420, NULL, NULL)) {
-            profile_list[profiles++] = VAProfileHEVCMain10;
+    AppendableBuffer tmp = job->sliceOffsets;
+    job->sliceOffsets = ctx->sliceOffsets;
+    ctx->sliceOffsets = tmp;
+    job->picParams.pSliceDataOffsets = job->sliceOffsets.buf;
+
+    ctx->submitQueueCount++;
+    pthread_cond_broadcast(&ctx->submitCondition);
+    pthread_mutex_unlock(&ctx->submitMutex);
+}
+
+static void* submitPictures(void *param) {
+    NVContext *ctx = (NVContext*) param;
+
+    applyThreadPlacement(ctx->drv);
+
+    LOG("[ST] Submission thread for %p started", ctx);
+    pthread_mutex_lock(&ctx->submitMutex);
+    while (true) {
+        while (ctx->submitQueueCount == 0 && !ctx->submitExiting) {
+            pthread_cond_wait(&ctx->submitCondition, &ctx->submitMutex);
         }
-        if (doesGPUSupportCodec(cudaVideoCodec_HEVC, 12, cudaVideoChromaFormat_420, NULL, NULL)) {
-            profile_list[profiles++] = VAProfileHEVCMain12;
+        //always drain the queue before exiting
+        if (ctx->submitQueueCount == 0) {
+            break;
         }
-        if (doesGPUSupportCodec(cudaVideoCodec_VP9, 10, cudaVideoChromaFormat_420, NULL, NULL)) {
-            profile_list[profiles++] = VAProfileVP9Profile2; //color depth: 10–12 bit, 4:2:0
+        NVSubmitJob *job = &ctx->submitQueue[ctx->submitQueueReadIdx];
+        pthread_mutex_unlock(&ctx->submitMutex);
+
+        submitPicture(ctx, &job->picParams, job->surface, job->deferResolve);
+        if (job->usesArena) {
+            releaseSliceData(ctx);
         }
+
+        pthread_mutex_lock(&ctx->submitMutex);
+        ctx->submitQueueReadIdx = (ctx->submitQueueReadIdx + 1) % SUBMIT_QUEUE_SIZE;
+        ctx->submitQueueCount--;
+        pthread_cond_broadcast(&ctx->submitCondition);
     }
+    pthread_mutex_unlock(&ctx->submitMutex);
 
-    if (drv->supports444Surface) {
-        if (doesGPUSupportCodec(cudaVideoCodec_HEVC, 8, cudaVideoChromaFormat_444, NULL, NULL)) {
-            profile_list[profiles++] = VAProfileHEVCMain444;
-        }
-        if (doesGPUSupportCodec(cudaVideoCodec_VP9, 8, cudaVideoChromaFormat_444, NULL, NULL)) {
-            profile_list[profiles++] = VAProfileVP9Profile1; //color depth: 8 bit, 4:2:2, 4:4:0, 4:4:4
-        }
-        if (doesGPUSupportCodec(cudaVideoCodec_AV1, 8, cudaVideoChromaFormat_444, NULL, NULL)) {
-            profile_list[profiles++] = VAProfileAV1Profile1;
-        }
+    LOG("[ST] Submission thread for %p exiting", ctx);
+    return NULL;
+}
 
+static int allocatePictureIdx(NVContext *ctx) {
+    int idx = -1;
+    pthread_mutex_lock(&ctx->pictureIdxMutex);
+    if (ctx->freePictureIdxCount > 0) {
+        idx = ctx->freePictureIdx[--ctx->freePictureIdxCount];
+    } else if (ctx->nextPictureIdx < (int) ctx->decoderInfo.ulNumDecodeSurfaces) {
+        idx = ctx->nextPictureIdx++;
+    }
+    pthread_mutex_unlock(&ctx->pictureIdxMutex);
+    return idx;
+}
+
+//the surface must be idle, otherwise the index could be handed out while NVDEC or the resolve pool still uses it
+static void releasePictureIdx(NVContext *ctx, NVSurface *surface) {
+    if (surface->pictureIdx < 0) {
+        return;
+    }
+    pthread_mutex_lock(&ctx->pictureIdxMutex);
+    ctx->freePictureIdx[ctx->freePictureIdxCount++] = surface->pictureIdx;
+    pthread_mutex_unlock(&ctx->pictureIdxMutex);
+    surface->pictureIdx = -1;
+}
+
+
+//every profile we can expose, in the order vaQueryConfigProfiles returns them, along with the decoder caps each one needs
+typedef struct {
+    VAProfile               profile;
+    cudaVideoCodec          codec;
+    cudaVideoChromaFormat   chromaFormat;
+    int                     bitDepth;
+} NVProfile;
+
+static const NVProfile nvProfiles[] = {
+    { VAProfileMPEG2Simple,             cudaVideoCodec_MPEG2,    cudaVideoChromaFormat_420, 8 },
+    { VAProfileMPEG2Main,               cudaVideoCodec_MPEG2,    cudaVideoChromaFormat_420, 8 },
+    { VAProfileMPEG4Simple,             cudaVideoCodec_MPEG4,    cudaVideoChromaFormat_420, 8 },
+    { VAProfileMPEG4AdvancedSimple,     cudaVideoCodec_MPEG4,    cudaVideoChromaFormat_420, 8 },
+    { VAProfileMPEG4Main,               cudaVideoCodec_MPEG4,    cudaVideoChromaFormat_420, 8 },
+    { VAProfileVC1Simple,               cudaVideoCodec_VC1,      cudaVideoChromaFormat_420, 8 },
+    { VAProfileVC1Main,                 cudaVideoCodec_VC1,      cudaVideoChromaFormat_420, 8 },
+    { VAProfileVC1Advanced,             cudaVideoCodec_VC1,      cudaVideoChromaFormat_420, 8 },
+    { VAProfileH264Baseline,            cudaVideoCodec_H264,     cudaVideoChromaFormat_420, 8 },
+    { VAProfileH264Main,                cudaVideoCodec_H264,     cudaVideoChromaFormat_420, 8 },
+    { VAProfileH264High,                cudaVideoCodec_H264,     cudaVideoChromaFormat_420, 8 },
+    { VAProfileH264ConstrainedBaseline, cudaVideoCodec_H264,     cudaVideoChromaFormat_420, 8 },
+    { VAProfileJPEGBaseline,            cudaVideoCodec_JPEG,     cudaVideoChromaFormat_420, 8 },
+    { VAProfileH264StereoHigh,          cudaVideoCodec_H264_SVC, cudaVideoChromaFormat_420, 8 },
+    { VAProfileH264MultiviewHigh,       cudaVideoCodec_H264_MVC, cudaVideoChromaFormat_420, 8 },
+    { VAProfileHEVCMain,                cudaVideoCodec_HEVC,     cudaVideoChromaFormat_420, 8 },
+    { VAProfileVP8Version0_3,           cudaVideoCodec_VP8,      cudaVideoChromaFormat_420, 8 },
+    { VAProfileVP9Profile0,             cudaVideoCodec_VP9,      cudaVideoChromaFormat_420, 8 }, //color depth: 8 bit, 4:2:0
+    { VAProfileAV1Profile0,             cudaVideoCodec_AV1,      cudaVideoChromaFormat_420, 8 },
+    { VAProfileHEVCMain10,              cudaVideoCodec_HEVC,     cudaVideoChromaFormat_420, 10 },
+    { VAProfileHEVCMain12,              cudaVideoCodec_HEVC,     cudaVideoChromaFormat_420, 12 },
+    { VAProfileVP9Profile2,             cudaVideoCodec_VP9,      cudaVideoChromaFormat_420, 10 }, //color depth: 10–12 bit, 4:2:0
+    { VAProfileHEVCMain444,             cudaVideoCodec_HEVC,     cudaVideoChromaFormat_444, 8 },
+    { VAProfileVP9Profile1,             cudaVideoCodec_VP9,      cudaVideoChromaFormat_444, 8 }, //color depth: 8 bit, 4:2:2, 4:4:0, 4:4:4
+    { VAProfileAV1Profile1,             cudaVideoCodec_AV1,      cudaVideoChromaFormat_444, 8 },
     // Currently VAAPI doesn't support yuv444p10 yuv444p12 and yuv444p16
 #if defined(VA_FOURCC_Q410) && defined(DRM_FORMAT_Q410)
-        if (drv->supports16BitSurface) {
-            if (doesGPUSupportCodec(cudaVideoCodec_HEVC, 10, cudaVideoChromaFormat_444, NULL, NULL)) {
-                profile_list[profiles++] = VAProfileHEVCMain444_10;
-            }
+    { VAProfileHEVCMain444_10,          cudaVideoCodec_HEVC,     cudaVideoChromaFormat_444, 10 },
 #if (defined(VA_FOURCC_Q412) && defined(DRM_FORMAT_Q412)) || (defined(VA_FOURCC_Q416) && defined(DRM_FORMAT_Q416))
-            if (doesGPUSupportCodec(cudaVideoCodec_HEVC, 12, cudaVideoChromaFormat_444, NULL, NULL)) {
-                profile_list[profiles++] = VAProfileHEVCMain444_12;
-            }
+    { VAProfileHEVCMain444_12,          cudaVideoCodec_HEVC,     cudaVideoChromaFormat_444, 12 },
 #endif
-            if (doesGPUSupportCodec(cudaVideoCodec_VP9, 10, cudaVideoChromaFormat_444, NULL, NULL)) {
-                profile_list[profiles++] = VAProfileVP9Profile3; //color depth: 10–12 bit, 4:2:2, 4:4:0, 4:4:4
-            }
-        }
+    { VAProfileVP9Profile3,             cudaVideoCodec_VP9,      cudaVideoChromaFormat_444, 10 }, //color depth: 10–12 bit, 4:2:2, 4:4:0, 4:4:4
 #endif
-    }
-
     // Nvidia decoder doesn't support 422 chroma layout
 #if 0
-    if (doesGPUSupportCodec(cudaVideoCodec_HEVC, 10, cudaVideoChromaFormat_422, NULL, NULL)) {
-        profile_list[profiles++] = VAProfileHEVCMain422_10;
-    }
-    if (doesGPUSupportCodec(cudaVideoCodec_HEVC, 12, cudaVideoChromaFormat_422, NULL, NULL)) {
-        profile_list[profiles++] = VAProfileHEVCMain422_12;
-    }
+    { VAProfileHEVCMain422_10,          cudaVideoCodec_HEVC,     cudaVideoChromaFormat_422, 10 },
+    { VAProfileHEVCMain422_12,          cudaVideoCodec_HEVC,     cudaVideoChromaFormat_422, 12 },
 #endif
+};
 
-    //now filter out the codecs we don't support
-    for (int i = 0; i < profiles; i++) {
-        if (vaToCuCodec(profile_list[i]) == cudaVideoCodec_NONE) {
-            //LOG("Removing profile: %d", profile_list[i])
-            for (int x = i; x < profiles-1; x++) {
-                profile_list[x] = profile_list[x+1];
-            }
-            profiles--;
-            i--;
+#define MAX_PROFILES 32
+static VAStatus nvQueryConfigProfiles(
+        VADriverContextP ctx,
+        VAProfile *profile_list,	/* out */
+        int *num_profiles			/* out */
+    )
+{
+    NVDriver *drv = (NVDriver*) ctx->pDriverData;
+
+    int profiles = 0;
+    for (uint32_t i = 0; i < ARRAY_SIZE(nvProfiles) && profiles < MAX_PROFILES; i++) {
+        const NVProfile *p = &nvProfiles[i];
+        if ((p->bitDepth > 8 && !drv->supports16BitSurface) || (p->chromaFormat == cudaVideoChromaFormat_444 && !drv->supports444Surface)) {
+            continue;
+        }
+        //filter out the codecs we don't support
+        if (vaToCuCodec(p->profile) == cudaVideoCodec_NONE) {
+            continue;
+        }
+        if (doesGPUSupportCodec(drv, p->codec, p->bitDepth, p->chromaFormat, NULL, NULL)) {
+            profile_list[profiles++] = p->profile;
         }
     }
 
     *num_profiles = profiles;
 
-    CHECK_CUDA_RESULT_RETURN(cu->cuCtxPopCurrent(NULL), VA_STATUS_ERROR_OPERATION_FAILED);
+    saveCodecCaps(drv);
 
     return VA_STATUS_SUCCESS;
 }
@@ -609,11 +1624,16 @@ static VAStatus nvGetConfigAttributes(
         }
         else if (attrib_list[i].type == VAConfigAttribMaxPictureWidth)
         {
-            doesGPUSupportCodec(vaToCuCodec(profile), 8, cudaVideoChromaFormat_420, &attrib_list[i].value, NULL);
+            doesGPUSupportCodec(drv, vaToCuCodec(profile), 8, cudaVideoChromaFormat_420, &attrib_list[i].value, NULL);
         }
         else if (attrib_list[i].type == VAConfigAttribMaxPictureHeight)
         {
-            doesGPUSupportCodec(vaToCuCodec(profile), 8, cudaVideoChromaFormat_420, NULL, &attrib_list[i].value);
+            doesGPUSupportCodec(drv, vaToCuCodec(profile), 8, cudaVideoChromaFormat_420, NULL, &attrib_list[i].value);
+        }
+        else if (attrib_list[i].type == VAConfigAttribContextPriority)
+        {
+            //the highest priority a context can be given, 0 is the lowest
+            attrib_list[i].value = NV_PRIORITY_LEVELS - 1;
         }
         else
         {
@@ -648,14 +1668,22 @@ static VAStatus nvCreateConfig(
         return VA_STATUS_ERROR_UNSUPPORTED_ENTRYPOINT;
     }
 
-    Object obj = allocateObject(drv, OBJECT_TYPE_CONFIG, sizeof(NVConfig));
+    Object obj = allocateObject(drv, OBJECT_TYPE_CONFIG);
+    if (obj == NULL) {
+        return VA_STATUS_ERROR_ALLOCATION_FAILED;
+    }
     NVConfig *cfg = (NVConfig*) obj->obj;
     cfg->profile = profile;
     cfg->entrypoint = entrypoint;
 
+    cfg->priority = -1;
+
     //this will contain all the attributes the client cares about
     for (int i = 0; i < num_attribs; i++) {
       LOG("got config attrib: %d %d %d", i, attrib_list[i].type, attrib_list[i].value);
+      if (attrib_list[i].type == VAConfigAttribContextPriority) {
+          cfg->priority = MIN(attrib_list[i].value & 0xffff, NV_PRIORITY_LEVELS - 1);
+      }
     }
 
     cfg->cudaCodec = cudaCodec;
@@ -839,6 +1867,11 @@ static VAStatus nvQueryConfigAttributes(
     }
 
     i++;
+    if (cfg->priority >= 0) {
+        attrib_list[i].type = VAConfigAttribContextPriority;
+        attrib_list[i].value = cfg->priority;
+        i++;
+    }
     *num_attribs = i;
     return VA_STATUS_SUCCESS;
 }
@@ -898,10 +1931,18 @@ static VAStatus nvCreateSurfaces2(
         return VA_STATUS_ERROR_UNSUPPORTED_RT_FORMAT;
     }
 
-    CHECK_CUDA_RESULT_RETURN(cu->cuCtxPushCurrent(drv->cudaContext), VA_STATUS_ERROR_OPERATION_FAILED);
+    if (!initGpu(drv)) {
+        return VA_STATUS_ERROR_OPERATION_FAILED;
+    }
+
+    CHECK_CUDA_RESULT_RETURN(pushContext(drv->cudaContext), VA_STATUS_ERROR_OPERATION_FAILED);
 
     for (uint32_t i = 0; i < num_surfaces; i++) {
-        Object surfaceObject = allocateObject(drv, OBJECT_TYPE_SURFACE, sizeof(NVSurface));
+        Object surfaceObject = allocateObject(drv, OBJECT_TYPE_SURFACE);
+        if (surfaceObject == NULL) {
+            CHECK_CUDA_RESULT_RETURN(popContext(), VA_STATUS_ERROR_OPERATION_FAILED);
+            return VA_STATUS_ERROR_ALLOCATION_FAILED;
+        }
         surfaces[i] = surfaceObject->id;
         NVSurface *suf = (NVSurface*) surfaceObject->obj;
         suf->width = width;
@@ -912,14 +1953,23 @@ static VAStatus nvCreateSurfaces2(
         suf->context = NULL;
         suf->chromaFormat = chromaFormat;
         pthread_mutex_init(&suf->mutex, NULL);
-        pthread_cond_init(&suf->cond, NULL);
+        //timed syncs use CLOCK_MONOTONIC deadlines
+        pthread_condattr_t condAttrib;
+        pthread_condattr_init(&condAttrib);
+        pthread_condattr_setclock(&condAttrib, CLOCK_MONOTONIC);
+        pthread_cond_init(&suf->cond, &condAttrib);
+        pthread_condattr_destroy(&condAttrib);
+        //timing isn't needed, and blocking sync lets nvSyncSurface sleep rather than spin
+        if (CHECK_CUDA_RESULT(cu->cuEventCreate(&suf->copyEvent, CU_EVENT_BLOCKING_SYNC | CU_EVENT_DISABLE_TIMING))) {
+            deleteObject(drv, surfaceObject->id);
+            CHECK_CUDA_RESULT_RETURN(popContext(), VA_STATUS_ERROR_OPERATION_FAILED);
+            return VA_STATUS_ERROR_ALLOCATION_FAILED;
+        }
 
         LOG("Creating surface %dx%d, format %X (%p)", width, height, format, suf);
     }
 
-    drv->surfaceCount += num_surfaces;
-
-    CHECK_CUDA_RESULT_RETURN(cu->cuCtxPopCurrent(NULL), VA_STATUS_ERROR_OPERATION_FAILED);
+    CHECK_CUDA_RESULT_RETURN(popContext(), VA_STATUS_ERROR_OPERATION_FAILED);
 
     return VA_STATUS_SUCCESS;
 }
@@ -950,16 +2000,41 @@ static VAStatus nvDestroySurfaces(
 
         LOG("Destroying surface %d (%p)", surface->pictureIdx, surface);
 
+        //the resolve pool may still have the surface queued, or mapped and waiting on its copy event, so it has to
+        //let go of it before the event is destroyed and the surface freed
+        waitForSurfaceIdle(surface);
+
+        if (surface->context != NULL) {
+            releasePictureIdx((NVContext*) surface->context, surface);
+        }
+
         drv->backend->detachBackingImageFromSurface(drv, surface);
 
+        if (surface->copyEvent != NULL) {
+            CHECK_CUDA_RESULT(pushContext(drv->cudaContext));
+            CHECK_CUDA_RESULT(cu->cuEventDestroy(surface->copyEvent));
+            CHECK_CUDA_RESULT(popContext());
+        }
+
         deleteObject(drv, surface_list[i]);
     }
 
-    drv->surfaceCount = MAX(drv->surfaceCount - num_surfaces, 0);
-
     return VA_STATUS_SUCCESS;
 }
 
+//high priority contexts get the highest stream priority, so their copies are scheduled on the copy engines first
+//CUDA has nothing below the default priority, so low priority contexts are only ordered by the resolve pool
+static CUresult createContextStream(NVContext *nvCtx) {
+    int leastPriority = 0, greatestPriority = 0;
+    if (nvCtx->priority == NV_PRIORITY_HIGH && cux != NULL && cux->cuStreamCreateWithPriority != NULL
+            && cux->cuCtxGetStreamPriorityRange != NULL
+            && cux->cuCtxGetStreamPriorityRange(&leastPriority, &greatestPriority) == CUDA_SUCCESS) {
+        LOG("Creating stream with priority %d", greatestPriority);
+        return cux->cuStreamCreateWithPriority(&nvCtx->stream, CU_STREAM_NON_BLOCKING, greatestPriority);
+    }
+    return cu->cuStreamCreate(&nvCtx->stream, CU_STREAM_NON_BLOCKING);
+}
+
 static VAStatus nvCreateContext(
         VADriverContextP ctx,
         VAConfigID config_id,
@@ -978,18 +2053,14 @@ static VAStatus nvCreateContext(
         return VA_STATUS_ERROR_INVALID_CONFIG;
     }
 
-    LOG("with %d render targets, %d surfaces, at %dx%d", num_render_targets, drv->surfaceCount, picture_width, picture_height);
+    if (!initGpu(drv)) {
+        return VA_STATUS_ERROR_OPERATION_FAILED;
+    }
+
+    LOG("with %d render targets, at %dx%d", num_render_targets, picture_width, picture_height);
 
     //find the codec they've selected
-    const NVCodec *selectedCodec = NULL;
-    for (const NVCodec *c = __start_nvd_codecs; c < __stop_nvd_codecs; c++) {
-        for (int i = 0; i < c->supportedProfileCount; i++) {
-            if (c->supportedProfiles[i] == cfg->profile) {
-                selectedCodec = c;
-                break;
-            }
-        }
-    }
+    const NVCodec *selectedCodec = codecForProfile(cfg->profile);
     if (selectedCodec == NULL) {
         LOG("Unable to find codec for profile: %d", cfg->profile);
         return VA_STATUS_ERROR_UNSUPPORTED_PROFILE;
@@ -1003,6 +2074,20 @@ static VAStatus nvCreateContext(
         cfg->bitDepth = surface->bitDepth;
     }
 
+    //catch sizes the decoder can't handle here, rather than as an allocation failure from cuvidCreateDecoder
+    CodecCaps caps;
+    uint32_t mbCount = ((picture_width + 15) / 16) * ((picture_height + 15) / 16);
+    if (getCodecCaps(drv, cfg->cudaCodec, cfg->bitDepth, cfg->chromaFormat, &caps) && caps.supported
+            && ((uint32_t) picture_width > caps.maxWidth || (uint32_t) picture_height > caps.maxHeight
+            || (caps.maxMBCount > 0 && mbCount > caps.maxMBCount))) {
+        LOG("%dx%d is larger than the decoder supports (%ux%u, %u macroblocks)", picture_width, picture_height,
+            caps.maxWidth, caps.maxHeight, caps.maxMBCount);
+        return VA_STATUS_ERROR_RESOLUTION_NOT_SUPPORTED;
+    }
+
+    //without render targets the surfaces may not have been created yet, so allow for as many as we can
+    int decodeSurfaces = num_render_targets > 0 ? num_render_targets : MAX_DECODE_SURFACES;
+
     CUVIDDECODECREATEINFO vdci = {
         .ulWidth             = vdci.ulMaxWidth  = vdci.ulTargetWidth  = picture_width,
         .ulHeight            = vdci.ulMaxHeight = vdci.ulTargetHeight = picture_height,
@@ -1016,47 +2101,128 @@ static VAStatus nvCreateContext(
         .bitDepthMinus8      = cfg->bitDepth - 8,
         .DeinterlaceMode     = cudaVideoDeinterlaceMode_Adaptive,
 
-        //we only ever map one frame at a time, so we can set this to 1
-        //it isn't particually efficient to do this, but it is simple
-        .ulNumOutputSurfaces = 1,
-        //just allocate as many surfaces as have been created since we can never have as much information as the decode to guess correctly
-        .ulNumDecodeSurfaces = drv->surfaceCount != 0 ? drv->surfaceCount : num_render_targets,
-
+        //the resolve pool keeps up to this many frames mapped at once
+        .ulNumOutputSurfaces = outputSurfaces,
+        //picture indices are recycled, so this only needs to cover the surfaces in use at once
+        .ulNumDecodeSurfaces = MIN(MAX(decodeSurfaces, MIN_DECODE_SURFACES), MAX_DECODE_SURFACES),
     };
 
-    //reset this to 0 as there are some cases where the context will be destroyed but not terminated, meaning if it's initialised again
-    //we'll have even more surfaces
-    drv->surfaceCount = 0;
-
     CHECK_CUDA_RESULT_RETURN(cv->cuvidCtxLockCreate(&vdci.vidLock, drv->cudaContext), VA_STATUS_ERROR_OPERATION_FAILED);
 
     CUvideodecoder decoder;
-    CHECK_CUDA_RESULT_RETURN(cv->cuvidCreateDecoder(&decoder, &vdci), VA_STATUS_ERROR_ALLOCATION_FAILED);
+    if (CHECK_CUDA_RESULT(cv->cuvidCreateDecoder(&decoder, &vdci))) {
+        cv->cuvidCtxLockDestroy(vdci.vidLock);
+        return VA_STATUS_ERROR_ALLOCATION_FAILED;
+    }
 
-    Object contextObj = allocateObject(drv, OBJECT_TYPE_CONTEXT, sizeof(NVContext));
+    Object contextObj = allocateObject(drv, OBJECT_TYPE_CONTEXT);
+    if (contextObj == NULL) {
+        cv->cuvidDestroyDecoder(decoder);
+        cv->cuvidCtxLockDestroy(vdci.vidLock);
+        return VA_STATUS_ERROR_ALLOCATION_FAILED;
+    }
     NVContext *nvCtx = (NVContext*) contextObj->obj;
     nvCtx->drv = drv;
     nvCtx->decoder = decoder;
+    nvCtx->vidLock = vdci.vidLock;
     nvCtx->profile = cfg->profile;
     nvCtx->entrypoint = cfg->entrypoint;
     nvCtx->width = picture_width;
     nvCtx->height = picture_height;
     nvCtx->codec = selectedCodec;
+    nvCtx->decoderInfo = vdci;
+    pthread_mutex_init(&nvCtx->pictureIdxMutex, NULL);
 
     pthread_mutexattr_t attrib;
     pthread_mutexattr_init(&attrib);
     pthread_mutexattr_settype(&attrib, PTHREAD_MUTEX_RECURSIVE);
     pthread_mutex_init(&nvCtx->surfaceCreationMutex, &attrib);
 
-    pthread_mutex_init(&nvCtx->resolveMutex, NULL);
-    pthread_cond_init(&nvCtx->resolveCondition, NULL);
-    int err = pthread_create(&nvCtx->resolveThread, NULL, &resolveSurfaces, nvCtx);
-    if (err != 0) {
-        LOG("Unable to create resolve thread: %d", err);
+    nvCtx->numOutputSurfaces = outputSurfaces;
+    if (!init_spsc_queue(&nvCtx->surfaceQueue, surfaceQueueDepth)) {
+        LOG("Unable to allocate resolve queue");
+        cv->cuvidDestroyDecoder(decoder);
+        cv->cuvidCtxLockDestroy(vdci.vidLock);
+        deleteObject(drv, contextObj->id);
+        return VA_STATUS_ERROR_ALLOCATION_FAILED;
+    }
+
+    if (cfg->priority >= 0) {
+        nvCtx->priority = cfg->priority;
+    } else if ((int64_t) picture_width * picture_height <= lowPriorityPixels) {
+        nvCtx->priority = NV_PRIORITY_LOW;
+    } else {
+        nvCtx->priority = NV_PRIORITY_NORMAL;
+    }
+
+    //a non-blocking stream doesn't synchronise with the null stream, so copies from different contexts can overlap
+    CHECK_CUDA_RESULT_RETURN(pushContext(drv->cudaContext), VA_STATUS_ERROR_OPERATION_FAILED);
+    CUresult streamResult = createContextStream(nvCtx);
+    CHECK_CUDA_RESULT_RETURN(popContext(), VA_STATUS_ERROR_OPERATION_FAILED);
+    if (streamResult != CUDA_SUCCESS) {
+        LOG("Unable to create stream: %d", streamResult);
+        free_spsc_queue(&nvCtx->surfaceQueue);
+        cv->cuvidDestroyDecoder(decoder);
+        cv->cuvidCtxLockDestroy(vdci.vidLock);
+        deleteObject(drv, contextObj->id);
+        return VA_STATUS_ERROR_ALLOCATION_FAILED;
+    }
+    pthread_mutex_init(&nvCtx->surfaceQueueMutex, NULL);
+    nvCtx->lazyResolve = lazyResolve;
+    pthread_mutex_init(&nvCtx->sliceArenaMutex, NULL);
+    nvCtx->sliceArenaWanted = SLICE_ARENA_INITIAL_SIZE;
+    pthread_mutex_init(&nvCtx->submitMutex, NULL);
+    pthread_condattr_t condAttrib;
+    pthread_condattr_init(&condAttrib);
+    pthread_condattr_setclock(&condAttrib, CLOCK_MONOTONIC);
+    pthread_cond_init(&nvCtx->submitCondition, &condAttrib);
+    pthread_condattr_destroy(&condAttrib);
+
+    if (pinnedBitstream) {
+        //none of these are write-combined, the CPU reads slice data back (header parsing and the copy fallback), cuvid reads
+        //the slice offsets, and growing any of them copies the old contents out
+        nvCtx->sliceArena.pinContext = drv->cudaContext;
+        nvCtx->sliceArena.pinFlags = CU_MEMHOSTALLOC_PORTABLE;
+        nvCtx->bitstreamBuffer.pinContext = drv->cudaContext;
+        nvCtx->bitstreamBuffer.pinFlags = CU_MEMHOSTALLOC_PORTABLE;
+        nvCtx->sliceOffsets.pinContext = drv->cudaContext;
+        nvCtx->sliceOffsets.pinFlags = CU_MEMHOSTALLOC_PORTABLE;
+    }
+    nvCtx->sliceArena.numaNode = drv->numaNode;
+    nvCtx->bitstreamBuffer.numaNode = drv->numaNode;
+    nvCtx->sliceOffsets.numaNode = drv->numaNode;
+
+    //the submission jobs swap buffers with the context, so they need to be allocated the same way
+    for (int i = 0; i < SUBMIT_QUEUE_SIZE; i++) {
+        nvCtx->submitQueue[i].bitstreamBuffer.pinContext = nvCtx->bitstreamBuffer.pinContext;
+        nvCtx->submitQueue[i].bitstreamBuffer.pinFlags = nvCtx->bitstreamBuffer.pinFlags;
+        nvCtx->submitQueue[i].sliceOffsets.pinContext = nvCtx->sliceOffsets.pinContext;
+        nvCtx->submitQueue[i].sliceOffsets.pinFlags = nvCtx->sliceOffsets.pinFlags;
+        nvCtx->submitQueue[i].bitstreamBuffer.numaNode = drv->numaNode;
+        nvCtx->submitQueue[i].sliceOffsets.numaNode = drv->numaNode;
+    }
+    if (!attachToResolvePool(drv, nvCtx)) {
+        //unwind in the reverse order everything was set up
+        if (pushContext(drv->cudaContext) == CUDA_SUCCESS) {
+            CHECK_CUDA_RESULT(cu->cuStreamDestroy(nvCtx->stream));
+            CHECK_CUDA_RESULT(cv->cuvidDestroyDecoder(decoder));
+            CHECK_CUDA_RESULT(cv->cuvidCtxLockDestroy(vdci.vidLock));
+            popContext();
+        }
+        free_spsc_queue(&nvCtx->surfaceQueue);
         deleteObject(drv, contextObj->id);
         return VA_STATUS_ERROR_OPERATION_FAILED;
     }
 
+    if (asyncSubmit) {
+        int err = pthread_create(&nvCtx->submitThread, NULL, &submitPictures, nvCtx);
+        if (err != 0) {
+            LOG("Unable to create submission thread, falling back to synchronous submission: %d", err);
+        } else {
+            nvCtx->asyncSubmit = true;
+        }
+    }
+
     *context = contextObj->id;
 
     return VA_STATUS_SUCCESS;
@@ -1114,25 +2280,45 @@ static VAStatus nvCreateBuffer(
         size += offset;
     }
 
-    //TODO should pool these as most of the time these should be the same size
-    Object bufferObject = allocateObject(drv, OBJECT_TYPE_BUFFER, sizeof(NVBuffer));
+    Object bufferObject = allocateObject(drv, OBJECT_TYPE_BUFFER);
+    if (bufferObject == NULL) {
+        return VA_STATUS_ERROR_ALLOCATION_FAILED;
+    }
     *buf_id = bufferObject->id;
 
     NVBuffer *buf = (NVBuffer*) bufferObject->obj;
     buf->bufferType = type;
     buf->elements = num_elements;
     buf->size = num_elements * size;
-    buf->ptr = memalign(16, buf->size);
     buf->offset = offset;
 
+    //if the codec supports it, put slice data straight into the arena that we pass to NVDEC
+    if (type == VASliceDataBufferType && nvCtx->codec->sliceDataInArena) {
+        buf->ptr = reserveSliceData(nvCtx, buf->size);
+        if (buf->ptr != NULL) {
+            buf->arenaContext = nvCtx;
+        }
+    }
+
+    //most of these are the same size every frame, so they'll nearly always come straight out of the pool
+    if (buf->ptr == NULL) {
+        buf->ptr = buffer_pool_alloc(&drv->bufferPool, buf->size);
+    }
+
     if (buf->ptr == NULL) {
         LOG("Unable to allocate buffer of %d bytes", buf->size);
+        deleteObject(drv, bufferObject->id);
         return VA_STATUS_ERROR_ALLOCATION_FAILED;
     }
 
     if (data != NULL)
     {
-        memcpy(buf->ptr, data, buf->size);
+        //parameter buffers, and slice data the codec parses itself, are read straight back so they need to stay in cache
+        if (type == VASliceDataBufferType && !nvCtx->codec->sliceDataParsed) {
+            fast_copy(buf->ptr, data, buf->size);
+        } else {
+            memcpy(buf->ptr, data, buf->size);
+        }
     }
 
     return VA_STATUS_SUCCESS;
@@ -1185,8 +2371,10 @@ static VAStatus nvDestroyBuffer(
         return VA_STATUS_ERROR_INVALID_BUFFER;
     }
 
-    if (buf->ptr != NULL) {
-        free(buf->ptr);
+    if (buf->arenaContext != NULL) {
+        releaseSliceData(buf->arenaContext);
+    } else {
+        buffer_pool_free(&drv->bufferPool, buf->ptr, buf->size);
     }
 
     deleteObject(drv, buffer_id);
@@ -1209,26 +2397,42 @@ static VAStatus nvBeginPicture(
     }
 
     if (surface->context != NULL && surface->context != nvCtx) {
+        //the last picture decoded into it may still be on its way through the other context
+        waitForSurfaceIdle(surface);
         //this surface was last used on a different context, we need to free up the backing image (it might not be the correct size)
         if (surface->backingImage != NULL) {
             drv->backend->detachBackingImageFromSurface(drv, surface);
         }
-        //...and reset the pictureIdx
-        surface->pictureIdx = -1;
+        //...and give the pictureIdx back
+        releasePictureIdx((NVContext*) surface->context, surface);
     }
+    surface->context = nvCtx;
 
-    //if this surface hasn't been used before, give it a new picture index
+    //if this surface hasn't been used on this context before, give it a picture index
+    //the decoder isn't grown when they run out, as reallocating its surfaces would throw away the reference frames
     if (surface->pictureIdx == -1) {
-        surface->pictureIdx = nvCtx->currentPictureId++;
+        surface->pictureIdx = allocatePictureIdx(nvCtx);
+        if (surface->pictureIdx == -1) {
+            LOG("Out of picture indices, decoder has %lu surfaces", nvCtx->decoderInfo.ulNumDecodeSurfaces);
+            return VA_STATUS_ERROR_MAX_NUM_EXCEEDED;
+        }
     }
 
     //I don't know if we actually need to lock here, nothing should be waiting
     //until after this function returns...
     pthread_mutex_lock(&surface->mutex);
     surface->resolving = 1;
+    surface->resolvePending = false;
+    surface->decodeFailed = false;
     pthread_mutex_unlock(&surface->mutex);
 
     memset(&nvCtx->pPicParams, 0, sizeof(CUVIDPICPARAMS));
+    nvCtx->bitstreamBuffer.size = 0;
+    nvCtx->sliceOffsets.size = 0;
+    nvCtx->bitstreamArenaSize = 0;
+    nvCtx->bitstreamCopied = false;
+    nvCtx->bitstreamFailed = false;
+    nvCtx->pictureHidden = false;
     nvCtx->renderTarget = surface;
     nvCtx->renderTarget->progressiveFrame = true; //assume we're producing progressive frame unless the codec says otherwise
     nvCtx->pPicParams.CurrPicIdx = nvCtx->renderTarget->pictureIdx;
@@ -1236,6 +2440,16 @@ static VAStatus nvBeginPicture(
     return VA_STATUS_SUCCESS;
 }
 
+static void updateContextParameters(NVContext *nvCtx, VAContextParameterUpdateBuffer *params) {
+    if (params->flags.bits.context_priority_update) {
+        //the stream keeps the priority it was created with, but the resolve pool picks this up straight away
+        pthread_mutex_lock(&nvCtx->drv->resolvePool.mutex);
+        nvCtx->priority = MIN(params->context_priority.bits.priority, NV_PRIORITY_LEVELS - 1);
+        pthread_mutex_unlock(&nvCtx->drv->resolvePool.mutex);
+        LOG("Context %p priority changed to %d", nvCtx, nvCtx->priority);
+    }
+}
+
 static VAStatus nvRenderPicture(
         VADriverContextP ctx,
         VAContextID context,
@@ -1252,12 +2466,37 @@ static VAStatus nvRenderPicture(
 
     CUVIDPICPARAMS *picParams = &nvCtx->pPicParams;
 
+    //work out how much slice data we've been given, so we only need to size the bitstream once
+    uint32_t sliceCount = 0;
+    uint64_t sliceBytes = 0;
+    bool inArena = true;
+    for (int i = 0; i < num_buffers; i++) {
+        NVBuffer *buf = (NVBuffer*) getObjectPtr(drv, buffers[i]);
+        if (buf == NULL || buf->ptr == NULL) {
+            continue;
+        }
+        if (buf->bufferType == VASliceParameterBufferType) {
+            sliceCount += buf->elements;
+        } else if (buf->bufferType == VASliceDataBufferType) {
+            sliceBytes += buf->size;
+            inArena = inArena && buf->arenaContext == nvCtx;
+        }
+    }
+    if (sliceBytes > 0 && !reserveSlices(nvCtx, MAX(sliceCount, nvCtx->lastSliceParamsCount), sliceBytes, inArena)) {
+        nvCtx->bitstreamFailed = true;
+        return VA_STATUS_ERROR_ALLOCATION_FAILED;
+    }
+
     for (int i = 0; i < num_buffers; i++) {
-        NVBuffer *buf = (NVBuffer*) getObject(drv, buffers[i])->obj;
+        NVBuffer *buf = (NVBuffer*) getObjectPtr(drv, buffers[i]);
         if (buf == NULL || buf->ptr == NULL) {
             LOG("Invalid buffer detected, skipping: %d", buffers[i]);
             continue;
         }
+        if (buf->bufferType == VAContextParameterUpdateBufferType) {
+            updateContextParameters(nvCtx, (VAContextParameterUpdateBuffer*) buf->ptr);
+            continue;
+        }
         HandlerFunc func = nvCtx->codec->handlers[buf->bufferType];
         if (func != NULL) {
             func(nvCtx, buf, picParams);
@@ -1275,45 +2514,81 @@ static VAStatus nvEndPicture(
     )
 {
     NVDriver *drv = (NVDriver*) ctx->pDriverData;
-    NVContext *nvCtx = (NVContext*) getObject(drv, context)->obj;
+    NVContext *nvCtx = (NVContext*) getObjectPtr(drv, context);
 
     if (nvCtx == NULL) {
         return VA_STATUS_ERROR_INVALID_CONTEXT;
     }
 
     CUVIDPICPARAMS *picParams = &nvCtx->pPicParams;
+    NVSurface *surface = nvCtx->renderTarget;
+
+    surface->context = nvCtx;
+    surface->topFieldFirst = !picParams->bottom_field_flag;
+    surface->secondField = picParams->second_field;
 
-    picParams->pBitstreamData = nvCtx->bitstreamBuffer.buf;
+    bool inArena = !nvCtx->bitstreamCopied && nvCtx->bitstreamArenaSize > 0;
+    if (inArena) {
+        picParams->pBitstreamData = PTROFF(nvCtx->sliceArena.buf, nvCtx->bitstreamArenaBase);
+    } else {
+        picParams->pBitstreamData = nvCtx->bitstreamBuffer.buf;
+    }
     picParams->pSliceDataOffsets = nvCtx->sliceOffsets.buf;
-    nvCtx->bitstreamBuffer.size = 0;
-    nvCtx->sliceOffsets.size = 0;
 
-    CUresult result = cv->cuvidDecodePicture(nvCtx->decoder, picParams);
-    if (result != CUDA_SUCCESS)
-    {
-        LOG("cuvidDecodePicture failed: %d", result);
-        return VA_STATUS_ERROR_DECODING_ERROR;
+    //hidden pictures aren't copied unless the application asks for them, but an exported surface can be read by the
+    //client without asking, so it's always copied
+    bool deferResolve = (nvCtx->lazyResolve || nvCtx->pictureHidden) && !surface->exported;
+    if (deferResolve && !nvCtx->lazyResolve) {
+        nvCtx->skippedResolves++;
     }
-    LOG("Decoded frame successfully to idx: %d (%p)", picParams->CurrPicIdx, nvCtx->renderTarget);
 
-    NVSurface *surface = nvCtx->renderTarget;
+    VAStatus status = VA_STATUS_SUCCESS;
+    if (nvCtx->bitstreamFailed) {
+        //part of the bitstream (or the slice offsets) is missing, so don't let NVDEC decode it
+        LOG("Unable to build the bitstream, dropping picture %d", surface->pictureIdx);
+        failSurface(surface);
+        status = VA_STATUS_ERROR_ALLOCATION_FAILED;
+    } else if (nvCtx->asyncSubmit) {
+        queueSubmission(nvCtx, picParams, surface, inArena, deferResolve);
+    } else if (!submitPicture(nvCtx, picParams, surface, deferResolve)) {
+        status = VA_STATUS_ERROR_DECODING_ERROR;
+    }
 
-    surface->context = nvCtx;
-    surface->topFieldFirst = !picParams->bottom_field_flag;
-    surface->secondField = picParams->second_field;
+    //NVDEC (or the submission queue) has taken the bitstream by now, so the arena can be reused
+    pthread_mutex_lock(&nvCtx->sliceArenaMutex);
+    nvCtx->bitstreamArenaSize = 0;
+    pthread_mutex_unlock(&nvCtx->sliceArenaMutex);
+    nvCtx->bitstreamCopied = false;
+    resetBuffer(&nvCtx->bitstreamBuffer);
+    resetBuffer(&nvCtx->sliceOffsets);
+
+    return status;
+}
+
+//needContents is set when the caller is going to read the backing image, which forces a deferred resolve
+static VAStatus syncSurface(NVDriver *drv, NVSurface *surface, uint64_t timeout_ns, bool needContents) {
+    struct timespec deadlineStorage;
+    const struct timespec *deadline = timeoutToDeadline(timeout_ns, &deadlineStorage);
+
+    //LOG("Syncing on surface: %d (%p)", surface->pictureIdx, surface);
+
+    //wait for resolve to occur before synchronising
+    VAStatus ret = waitForSurfaceResolved(surface, deadline);
 
-    //TODO check we're not overflowing the queue
-    pthread_mutex_lock(&nvCtx->resolveMutex);
-    nvCtx->surfaceQueue[nvCtx->surfaceQueueWriteIdx++] = nvCtx->renderTarget;
-    if (nvCtx->surfaceQueueWriteIdx >= SURFACE_QUEUE_SIZE) {
-        nvCtx->surfaceQueueWriteIdx = 0;
+    //an exported surface can be read by the client as soon as this returns
+    if (ret == VA_STATUS_SUCCESS && (needContents || surface->exported) && surface->resolvePending) {
+        requestSurfaceResolve(surface);
+        ret = waitForSurfaceResolved(surface, deadline);
     }
-    pthread_mutex_unlock(&nvCtx->resolveMutex);
 
-    //Wake up the resolve thread
-    pthread_cond_signal(&nvCtx->resolveCondition);
+    //the resolve pool only queues the copy, so wait for it to land in the backing image
+    if (ret == VA_STATUS_SUCCESS) {
+        ret = waitForSurfaceCopy(drv, surface, deadline);
+    }
 
-    return VA_STATUS_SUCCESS;
+    //LOG("Surface %d resolved (%p)", surface->pictureIdx, surface);
+
+    return ret;
 }
 
 static VAStatus nvSyncSurface(
@@ -1328,20 +2603,65 @@ static VAStatus nvSyncSurface(
         return VA_STATUS_ERROR_INVALID_SURFACE;
     }
 
-    //LOG("Syncing on surface: %d (%p)", surface->pictureIdx, surface);
+    return syncSurface(drv, surface, UINT64_MAX, false);
+}
 
-    //wait for resolve to occur before synchronising
-    pthread_mutex_lock(&surface->mutex);
-    if (surface->resolving) {
-        LOG("Surface %d not resolved, waiting", surface->pictureIdx);
-        pthread_cond_wait(&surface->cond, &surface->mutex);
+#if VA_CHECK_VERSION(1, 9, 0)
+static VAStatus nvSyncSurface2(
+        VADriverContextP ctx,
+        VASurfaceID surface_id,
+        uint64_t timeout_ns
+    )
+{
+    NVDriver *drv = (NVDriver*) ctx->pDriverData;
+    NVSurface *surface = getObjectPtr(drv, surface_id);
+
+    if (surface == NULL) {
+        return VA_STATUS_ERROR_INVALID_SURFACE;
     }
-    pthread_mutex_unlock(&surface->mutex);
 
-    //LOG("Surface %d resolved (%p)", surface->pictureIdx, surface);
+    //VA_TIMEOUT_INFINITE is UINT64_MAX, which syncSurface already treats as no timeout
+    return syncSurface(drv, surface, timeout_ns, false);
+}
 
-    return VA_STATUS_SUCCESS;
+static VAStatus nvSyncBuffer(
+        VADriverContextP ctx,
+        VABufferID buf_id,
+        uint64_t timeout_ns
+    )
+{
+    NVDriver *drv = (NVDriver*) ctx->pDriverData;
+    NVBuffer *buf = getObjectPtr(drv, buf_id);
+
+    if (buf == NULL) {
+        return VA_STATUS_ERROR_INVALID_BUFFER;
+    }
+
+    //we only decode, so the only buffers that are still in use after vaEndPicture returns are slice data buffers
+    //in the arena that are waiting for the submission thread to pass them to NVDEC
+    NVContext *nvCtx = buf->arenaContext;
+    if (nvCtx == NULL || !nvCtx->asyncSubmit) {
+        return VA_STATUS_SUCCESS;
+    }
+
+    struct timespec deadlineStorage;
+    const struct timespec *deadline = timeoutToDeadline(timeout_ns, &deadlineStorage);
+    VAStatus ret = VA_STATUS_SUCCESS;
+
+    pthread_mutex_lock(&nvCtx->submitMutex);
+    while (nvCtx->submitQueueCount > 0) {
+        if (deadline == NULL) {
+            pthread_cond_wait(&nvCtx->submitCondition, &nvCtx->submitMutex);
+        } else if (pthread_cond_timedwait(&nvCtx->submitCondition, &nvCtx->submitMutex, deadline) == ETIMEDOUT) {
+            ret = VA_STATUS_ERROR_TIMEDOUT;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&nvCtx->submitMutex);
+
+    return ret;
 }
+#endif
 
 static VAStatus nvQuerySurfaceStatus(
         VADriverContextP ctx,
@@ -1349,7 +2669,61 @@ static VAStatus nvQuerySurfaceStatus(
         VASurfaceStatus *status	/* out */
     )
 {
-    return VA_STATUS_ERROR_UNIMPLEMENTED;
+    NVDriver *drv = (NVDriver*) ctx->pDriverData;
+    NVSurface *surface = getObjectPtr(drv, render_target);
+
+    if (surface == NULL) {
+        return VA_STATUS_ERROR_INVALID_SURFACE;
+    }
+
+    CHECK_CUDA_RESULT_RETURN(pushContext(drv->cudaContext), VA_STATUS_ERROR_OPERATION_FAILED);
+    pthread_mutex_lock(&surface->mutex);
+    bool resolving = surface->resolving;
+    bool failed = surface->decodeFailed;
+    bool resolvePending = surface->resolvePending && surface->exported;
+    //none of this blocks, so clients can poll as many surfaces as they like
+    if (resolving) {
+        //still in NVDEC or waiting on the resolve pool, the decode status is only used to report errors early
+        //destroyContext clears surface->context under the surface mutex before destroying the decoder, so holding
+        //it keeps the decoder alive for the call
+        NVContext *nvCtx = (NVContext*) surface->context;
+        if (nvCtx != NULL && nvCtx->decoder != NULL) {
+            CUVIDGETDECODESTATUS decodeStatus = {0};
+            if (cv->cuvidGetDecodeStatus(nvCtx->decoder, surface->pictureIdx, &decodeStatus) == CUDA_SUCCESS
+                    && decodeStatus.decodeStatus >= cuvidDecodeStatus_Error) {
+                LOG("Surface %d decode status: %d", surface->pictureIdx, decodeStatus.decodeStatus);
+            }
+        }
+    }
+    pthread_mutex_unlock(&surface->mutex);
+    CHECK_CUDA_RESULT_RETURN(popContext(), VA_STATUS_ERROR_OPERATION_FAILED);
+
+    //a client polling an exported surface is going to read it without syncing, so it has to be resolved now
+    if (resolvePending) {
+        requestSurfaceResolve(surface);
+        resolving = true;
+    }
+
+    if (resolving) {
+        *status = VASurfaceRendering;
+        return VA_STATUS_SUCCESS;
+    }
+
+    //the copy into the backing image may still be in flight on the context's stream
+    if (!failed && surface->copyEvent != NULL) {
+        CHECK_CUDA_RESULT_RETURN(pushContext(drv->cudaContext), VA_STATUS_ERROR_OPERATION_FAILED);
+        CUresult result = cu->cuEventQuery(surface->copyEvent);
+        CHECK_CUDA_RESULT_RETURN(popContext(), VA_STATUS_ERROR_OPERATION_FAILED);
+        if (result == CUDA_ERROR_NOT_READY) {
+            *status = VASurfaceRendering;
+            return VA_STATUS_SUCCESS;
+        }
+        CHECK_CUDA_RESULT(result);
+    }
+
+    //failed decodes are reported through vaSyncSurface/vaQuerySurfaceError, as far as the client is concerned the surface is done with
+    *status = VASurfaceReady;
+    return VA_STATUS_SUCCESS;
 }
 
 static VAStatus nvQuerySurfaceError(
@@ -1359,8 +2733,34 @@ static VAStatus nvQuerySurfaceError(
         void **error_info /*out*/
     )
 {
-    LOG("In %s", __func__);
-    return VA_STATUS_ERROR_UNIMPLEMENTED;
+    NVDriver *drv = (NVDriver*) ctx->pDriverData;
+    NVSurface *surface = getObjectPtr(drv, render_target);
+
+    if (surface == NULL) {
+        return VA_STATUS_ERROR_INVALID_SURFACE;
+    }
+
+    if (error_status != VA_STATUS_ERROR_DECODING_ERROR) {
+        return VA_STATUS_ERROR_UNIMPLEMENTED;
+    }
+
+    //NVDEC doesn't tell us which macroblocks were bad, so if submission failed report the whole picture
+    pthread_mutex_lock(&surface->mutex);
+    memset(surface->decodeErrors, 0, sizeof(surface->decodeErrors));
+    int i = 0;
+    if (surface->decodeFailed) {
+        surface->decodeErrors[i].status = 1;
+        surface->decodeErrors[i].start_mb = 0;
+        surface->decodeErrors[i].end_mb = ((surface->width + 15) / 16) * ((surface->height + 15) / 16) - 1;
+        surface->decodeErrors[i].decode_error_type = VADecodeMBError;
+        i++;
+    }
+    surface->decodeErrors[i].status = -1;
+    pthread_mutex_unlock(&surface->mutex);
+
+    *error_info = surface->decodeErrors;
+
+    return VA_STATUS_SUCCESS;
 }
 
 static VAStatus nvPutSurface(
@@ -1425,7 +2825,10 @@ static VAStatus nvCreateImage(
         return VA_STATUS_ERROR_INVALID_IMAGE_FORMAT;
     }
 
-    Object imageObj = allocateObject(drv, OBJECT_TYPE_IMAGE, sizeof(NVImage));
+    Object imageObj = allocateObject(drv, OBJECT_TYPE_IMAGE);
+    if (imageObj == NULL) {
+        return VA_STATUS_ERROR_ALLOCATION_FAILED;
+    }
     image->image_id = imageObj->id;
 
     LOG("created image id: %d", imageObj->id);
@@ -1436,8 +2839,11 @@ static VAStatus nvCreateImage(
     img->format = nvFormat;
 
     //allocate buffer to hold image when we copy down from the GPU
-    //TODO could probably put these in a pool, they appear to be allocated, used, then freed
-    Object imageBufferObject = allocateObject(drv, OBJECT_TYPE_BUFFER, sizeof(NVBuffer));
+    Object imageBufferObject = allocateObject(drv, OBJECT_TYPE_BUFFER);
+    if (imageBufferObject == NULL) {
+        deleteObject(drv, imageObj->id);
+        return VA_STATUS_ERROR_ALLOCATION_FAILED;
+    }
     NVBuffer *imageBuffer = (NVBuffer*) imageBufferObject->obj;
     imageBuffer->bufferType = VAImageBufferType;
     imageBuffer->size = 0;
@@ -1445,9 +2851,10 @@ static VAStatus nvCreateImage(
         imageBuffer->size += ((width * height) >> (p[i].ss.x + p[i].ss.y)) * fmtInfo->bppc * p[i].channelCount;
     }
     imageBuffer->elements = 1;
-    imageBuffer->ptr = memalign(16, imageBuffer->size);
+    imageBuffer->ptr = buffer_pool_alloc(&drv->bufferPool, imageBuffer->size);
 
     img->imageBuffer = imageBuffer;
+    img->imageBufferId = imageBufferObject->id;
 
     memcpy(&image->format, format, sizeof(VAImageFormat));
     image->buf = imageBufferObject->id;	/* image data buffer */
@@ -1503,11 +2910,9 @@ static VAStatus nvDestroyImage(
         return VA_STATUS_ERROR_INVALID_IMAGE;
     }
 
-    Object imageBufferObj = getObjectByPtr(drv, img->imageBuffer);
+    Object imageBufferObj = getObject(drv, img->imageBufferId);
     if (imageBufferObj != NULL) {
-        if (img->imageBuffer->ptr != NULL) {
-            free(img->imageBuffer->ptr);
-        }
+        buffer_pool_free(&drv->bufferPool, img->imageBuffer->ptr, img->imageBuffer->size);
 
         deleteObject(drv, imageBufferObj->id);
     }
@@ -1555,7 +2960,10 @@ static VAStatus nvGetImage(
     }
 
     //wait for the surface to be decoded
-    nvSyncSurface(ctx, surface);
+    VAStatus status = syncSurface(drv, surfaceObj, UINT64_MAX, true);
+    if (status != VA_STATUS_SUCCESS) {
+        return status;
+    }
 
     for (uint32_t i = 0; i < fmtInfo->numPlanes; i++) {
         const NVFormatPlane *p = &fmtInfo->plane[i];
@@ -1774,35 +3182,30 @@ static VAStatus nvQuerySurfaceAttributes(
     }
 
     if (attrib_list != NULL) {
-        CUVIDDECODECAPS videoDecodeCaps = {
-            .eCodecType      = cfg->cudaCodec,
-            .eChromaFormat   = cfg->chromaFormat,
-            .nBitDepthMinus8 = cfg->bitDepth - 8
-        };
-
-        CHECK_CUDA_RESULT_RETURN(cu->cuCtxPushCurrent(drv->cudaContext), VA_STATUS_ERROR_OPERATION_FAILED);
-        CHECK_CUDA_RESULT_RETURN(cv->cuvidGetDecoderCaps(&videoDecodeCaps), VA_STATUS_ERROR_OPERATION_FAILED);
-        CHECK_CUDA_RESULT_RETURN(cu->cuCtxPopCurrent(NULL), VA_STATUS_ERROR_OPERATION_FAILED);
+        CodecCaps caps;
+        if (!getCodecCaps(drv, cfg->cudaCodec, cfg->bitDepth, cfg->chromaFormat, &caps)) {
+            return VA_STATUS_ERROR_OPERATION_FAILED;
+        }
 
         attrib_list[0].type = VASurfaceAttribMinWidth;
         attrib_list[0].flags = 0;
         attrib_list[0].value.type = VAGenericValueTypeInteger;
-        attrib_list[0].value.value.i = videoDecodeCaps.nMinWidth;
+        attrib_list[0].value.value.i = caps.minWidth;
 
         attrib_list[1].type = VASurfaceAttribMinHeight;
         attrib_list[1].flags = 0;
         attrib_list[1].value.type = VAGenericValueTypeInteger;
-        attrib_list[1].value.value.i = videoDecodeCaps.nMinHeight;
+        attrib_list[1].value.value.i = caps.minHeight;
 
         attrib_list[2].type = VASurfaceAttribMaxWidth;
         attrib_list[2].flags = 0;
         attrib_list[2].value.type = VAGenericValueTypeInteger;
-        attrib_list[2].value.value.i = videoDecodeCaps.nMaxWidth;
+        attrib_list[2].value.value.i = caps.maxWidth;
 
         attrib_list[3].type = VASurfaceAttribMaxHeight;
         attrib_list[3].flags = 0;
         attrib_list[3].value.type = VAGenericValueTypeInteger;
-        attrib_list[3].value.value.i = videoDecodeCaps.nMaxHeight;
+        attrib_list[3].value.value.i = caps.maxHeight;
 
         LOG("Returning constraints: width: %d - %d, height: %d - %d", attrib_list[0].value.value.i, attrib_list[2].value.value.i, attrib_list[1].value.value.i, attrib_list[3].value.value.i);
 
@@ -2031,7 +3434,7 @@ static VAStatus nvExportSurfaceHandle(
 
     LOG("Exporting surface: %d (%p)", surface->pictureIdx, surface);
 
-    CHECK_CUDA_RESULT_RETURN(cu->cuCtxPushCurrent(drv->cudaContext), VA_STATUS_ERROR_OPERATION_FAILED);
+    CHECK_CUDA_RESULT_RETURN(pushContext(drv->cudaContext), VA_STATUS_ERROR_OPERATION_FAILED);
 
     if (!drv->backend->realiseSurface(drv, surface)) {
         LOG("Unable to export surface");
@@ -2042,35 +3445,183 @@ static VAStatus nvExportSurfaceHandle(
 
     drv->backend->fillExportDescriptor(drv, surface, ptr);
 
+    //from now on the client can read the surface after syncing it, so it has to be resolved
+    surface->exported = true;
+    requestSurfaceResolve(surface);
+
     LOG("Exporting with %d %d %d %d %lx %d %d %lx", ptr->width, ptr->height, ptr->layers[0].offset[0], ptr->layers[0].pitch[0], ptr->objects[0].drm_format_modifier, ptr->layers[1].offset[0], ptr->layers[1].pitch[0], ptr->objects[1].drm_format_modifier);
 
-    CHECK_CUDA_RESULT_RETURN(cu->cuCtxPopCurrent(NULL), VA_STATUS_ERROR_OPERATION_FAILED);
+    CHECK_CUDA_RESULT_RETURN(popContext(), VA_STATUS_ERROR_OPERATION_FAILED);
 
     return VA_STATUS_SUCCESS;
 }
 
+//exporter state for each GPU in use, only shared alongside the primary context since the EGLStream connection
+//belongs to the context that was current when it was made
+static pthread_mutex_t sharedGpuMutex = PTHREAD_MUTEX_INITIALIZER;
+static NVGpu *sharedGpus;
+
+NVGpu *lockSharedGpu(const NVBackend *backend, uintptr_t key) {
+    pthread_mutex_lock(&sharedGpuMutex);
+    if (sharedContext) {
+        for (NVGpu *gpu = sharedGpus; gpu != NULL; gpu = gpu->next) {
+            if (gpu->backend == backend && gpu->key == key) {
+                return gpu;
+            }
+        }
+    }
+
+    NVGpu *gpu = calloc(1, sizeof(NVGpu));
+    if (gpu == NULL) {
+        pthread_mutex_unlock(&sharedGpuMutex);
+        return NULL;
+    }
+    gpu->backend = backend;
+    gpu->key = key;
+    gpu->cudaGpuId = -1;
+    pthread_mutex_init(&gpu->exportMutex, NULL);
+    if (sharedContext) {
+        gpu->next = sharedGpus;
+        sharedGpus = gpu;
+    }
+    return gpu;
+}
+
+static void unlinkSharedGpu(NVGpu *gpu) {
+    for (NVGpu **it = &sharedGpus; *it != NULL; it = &(*it)->next) {
+        if (*it == gpu) {
+            *it = gpu->next;
+            break;
+        }
+    }
+}
+
+void unlockSharedGpu(NVGpu *gpu, bool keep) {
+    if (keep) {
+        gpu->refs++;
+        LOG("Using exporter for GPU %d, shared by %u instances", gpu->cudaGpuId, gpu->refs);
+    } else if (gpu->refs == 0) {
+        //the first instance failed to set it up
+        unlinkSharedGpu(gpu);
+        pthread_mutex_unlock(&sharedGpuMutex);
+        freeSharedGpu(gpu);
+        return;
+    }
+    pthread_mutex_unlock(&sharedGpuMutex);
+}
+
+bool releaseSharedGpu(NVGpu *gpu) {
+    pthread_mutex_lock(&sharedGpuMutex);
+    bool last = --gpu->refs == 0;
+    if (last) {
+        unlinkSharedGpu(gpu);
+    }
+    pthread_mutex_unlock(&sharedGpuMutex);
+    return last;
+}
+
+void freeSharedGpu(NVGpu *gpu) {
+    pthread_mutex_destroy(&gpu->exportMutex);
+    free(gpu);
+}
+
+//primary contexts retained by driver instances in this process, CUDA keeps its own count as well but we need to know
+//when we're the first user so the flags are only set once
+#define MAX_SHARED_GPUS 16
+static pthread_mutex_t sharedContextMutex = PTHREAD_MUTEX_INITIALIZER;
+static uint32_t sharedContextRefs[MAX_SHARED_GPUS];
+
+static bool acquireCudaContext(NVDriver *drv) {
+    CUdevice device = drv->cudaGpuId;
+    if (!sharedContext || device < 0 || device >= MAX_SHARED_GPUS) {
+        drv->sharedContext = false;
+        if (CHECK_CUDA_RESULT(cu->cuCtxCreate(&drv->cudaContext, CU_CTX_SCHED_BLOCKING_SYNC, device))) {
+            return false;
+        }
+        //cuCtxCreate leaves the context current, but it's pushed whenever it's needed
+        CHECK_CUDA_RESULT(cu->cuCtxPopCurrent(NULL));
+        return true;
+    }
+
+    pthread_mutex_lock(&sharedContextMutex);
+    if (sharedContextRefs[device] == 0) {
+        //this fails if the application already has the primary context active, in which case we use it with its flags
+        CUresult result = cu->cuDevicePrimaryCtxSetFlags(device, CU_CTX_SCHED_BLOCKING_SYNC);
+        if (result != CUDA_SUCCESS) {
+            LOG("Unable to set primary context flags: %d", result);
+        }
+    }
+    if (CHECK_CUDA_RESULT(cu->cuDevicePrimaryCtxRetain(&drv->cudaContext, device))) {
+        pthread_mutex_unlock(&sharedContextMutex);
+        return false;
+    }
+    sharedContextRefs[device]++;
+    LOG("Using primary context for GPU %d, shared by %u instances", device, sharedContextRefs[device]);
+    pthread_mutex_unlock(&sharedContextMutex);
+
+    drv->sharedContext = true;
+    return true;
+}
+
+static void releaseCudaContext(NVDriver *drv) {
+    if (!drv->sharedContext) {
+        CHECK_CUDA_RESULT(cu->cuCtxDestroy(drv->cudaContext));
+        drv->cudaContext = NULL;
+        return;
+    }
+
+    pthread_mutex_lock(&sharedContextMutex);
+    CHECK_CUDA_RESULT(cu->cuDevicePrimaryCtxRelease(drv->cudaGpuId));
+    sharedContextRefs[drv->cudaGpuId]--;
+    pthread_mutex_unlock(&sharedContextMutex);
+    drv->cudaContext = NULL;
+}
+
 static VAStatus nvTerminate( VADriverContextP ctx )
 {
     NVDriver *drv = (NVDriver*) ctx->pDriverData;
     LOG("Terminating %p", ctx);
 
-    CHECK_CUDA_RESULT_RETURN(cu->cuCtxPushCurrent(drv->cudaContext), VA_STATUS_ERROR_OPERATION_FAILED);
+    //if nothing ever needed the GPU there's no exporter or CUDA context to clean up
+    bool gpuInitialised = drv->gpuInitialised;
+    if (gpuInitialised) {
+        CHECK_CUDA_RESULT_RETURN(pushContext(drv->cudaContext), VA_STATUS_ERROR_OPERATION_FAILED);
 
-    drv->backend->destroyAllBackingImage(drv);
+        drv->backend->destroyAllBackingImage(drv);
+    }
 
     deleteAllObjects(drv);
+    stopResolvePool(drv);
+    freeObjectSlabs(drv);
+    LOG("Buffer pool: %" PRIu64 " hits, %" PRIu64 " misses, %" PRIu64 " oversize", drv->bufferPool.hits, drv->bufferPool.misses, drv->bufferPool.oversize);
+    free_buffer_pool(&drv->bufferPool);
+
+    if (gpuInitialised) {
+        drv->backend->releaseExporter(drv);
+    }
 
-    drv->backend->releaseExporter(drv);
+    saveCodecCaps(drv);
 
-    CHECK_CUDA_RESULT_RETURN(cu->cuCtxPopCurrent(NULL), VA_STATUS_ERROR_OPERATION_FAILED);
+    if (gpuInitialised) {
+        CHECK_CUDA_RESULT_RETURN(popContext(), VA_STATUS_ERROR_OPERATION_FAILED);
+    }
 
     pthread_mutex_lock(&concurrency_mutex);
     instances--;
     LOG("Now have %d (%d max) instances", instances, max_instances);
+    bool lastInstance = instances == 0;
     pthread_mutex_unlock(&concurrency_mutex);
 
-    CHECK_CUDA_RESULT_RETURN(cu->cuCtxDestroy(drv->cudaContext), VA_STATUS_ERROR_OPERATION_FAILED);
-    drv->cudaContext = NULL;
+    //the copy workers are joined here rather than in a destructor, as the library may be unloaded from a thread
+    //they'd be waiting on
+    if (lastInstance) {
+        release_fast_copy();
+    }
+
+    if (gpuInitialised) {
+        unbindContext(drv->cudaContext);
+        releaseCudaContext(drv);
+    }
 
     return VA_STATUS_SUCCESS;
 }
@@ -2078,6 +3629,110 @@ static VAStatus nvTerminate( VADriverContextP ctx )
 extern const NVBackend DIRECT_BACKEND;
 extern const NVBackend EGL_BACKEND;
 
+//works out which NUMA node the GPU hangs off, so our threads and page-locked memory can be kept close to it
+static void findNumaPlacement(NVDriver *drv) {
+    drv->numaNode = -1;
+    drv->hasNumaCpus = false;
+
+    const char *source = "NVD_NUMA_NODE";
+    if (numaNodeOverride != -2) {
+        drv->numaNode = numaNodeOverride;
+    } else {
+        //prefer the DRM device we were given, otherwise ask CUDA where the GPU is
+        drv->numaNode = numa_node_from_drm_fd(drv->drmFd);
+        source = "DRM device";
+        CUdevice device;
+        if (drv->numaNode < 0 && pushContext(drv->cudaContext) == CUDA_SUCCESS) {
+            int domain = 0, bus = 0, dev = 0;
+            if (cu->cuCtxGetDevice(&device) == CUDA_SUCCESS
+                    && cu->cuDeviceGetAttribute(&domain, CU_DEVICE_ATTRIBUTE_PCI_DOMAIN_ID, device) == CUDA_SUCCESS
+                    && cu->cuDeviceGetAttribute(&bus, CU_DEVICE_ATTRIBUTE_PCI_BUS_ID, device) == CUDA_SUCCESS
+                    && cu->cuDeviceGetAttribute(&dev, CU_DEVICE_ATTRIBUTE_PCI_DEVICE_ID, device) == CUDA_SUCCESS) {
+                char busId[32];
+                snprintf(busId, sizeof(busId), "%04x:%02x:%02x.0", domain, bus, dev);
+                drv->numaNode = numa_node_from_pci_bus_id(busId);
+                source = busId;
+            }
+            popContext();
+        }
+    }
+
+    if (drv->numaNode < 0) {
+        LOG("No NUMA placement for GPU");
+        return;
+    }
+
+    drv->hasNumaCpus = numa_node_cpus(drv->numaNode, &drv->numaCpus);
+    LOG("GPU is on NUMA node %d (from %s), worker threads %s", drv->numaNode, source,
+        drv->hasNumaCpus ? "pinned to its CPUs" : "not pinned, node has no CPUs");
+}
+
+//brings up the exporter and the CUDA context, this is put off until something actually needs the GPU so applications
+//that only query what we support don't wake it up, or pay for creating a context
+static bool initGpu(NVDriver *drv) {
+    pthread_mutex_lock(&drv->gpuMutex);
+    if (drv->gpuInitialised || drv->gpuInitFailed) {
+        pthread_mutex_unlock(&drv->gpuMutex);
+        return drv->gpuInitialised;
+    }
+
+    LOG("Initialising GPU");
+    pthread_once(&cudaInitOnce, initCuda);
+
+    if (!drv->backend->initExporter(drv)) {
+        drv->gpuInitFailed = true;
+        pthread_mutex_unlock(&drv->gpuMutex);
+        return false;
+    }
+
+    if (!acquireCudaContext(drv)) {
+        drv->backend->releaseExporter(drv);
+        drv->gpuInitFailed = true;
+        pthread_mutex_unlock(&drv->gpuMutex);
+        return false;
+    }
+
+    //make sure the caps we've been answering with are for the GPU that was actually picked
+    CUuuid uuid;
+    if (cu->cuDeviceGetUuid != NULL && !CHECK_CUDA_RESULT(cu->cuDeviceGetUuid(&uuid, drv->cudaGpuId))) {
+        loadCodecCaps(drv, (const uint8_t*) uuid.bytes);
+    }
+    pthread_mutex_lock(&drv->capsMutex);
+    if (!drv->caps.surfaceFormatsProbed || drv->caps.supports16BitSurface != drv->supports16BitSurface
+            || drv->caps.supports444Surface != drv->supports444Surface) {
+        drv->caps.surfaceFormatsProbed = 1;
+        drv->caps.supports16BitSurface = drv->supports16BitSurface;
+        drv->caps.supports444Surface = drv->supports444Surface;
+        drv->capsDirty = true;
+    }
+    pthread_mutex_unlock(&drv->capsMutex);
+
+    findNumaPlacement(drv);
+
+    drv->gpuInitialised = true;
+    pthread_mutex_unlock(&drv->gpuMutex);
+    return true;
+}
+
+//undoes what __vaDriverInit set up if the GPU can't be initialised, initGpu has already released anything it acquired
+static void abortDriverInit(VADriverContextP ctx, NVDriver *drv) {
+    freeObjectSlabs(drv);
+    free_buffer_pool(&drv->bufferPool);
+    pthread_cond_destroy(&drv->resolvePool.idleCondition);
+    pthread_cond_destroy(&drv->resolvePool.cond);
+    pthread_mutex_destroy(&drv->resolvePool.mutex);
+    pthread_mutex_destroy(&drv->capsMutex);
+    pthread_mutex_destroy(&drv->gpuMutex);
+    pthread_mutex_destroy(&drv->imagesMutex);
+    pthread_mutex_destroy(&drv->objectCreationMutex);
+    free(drv);
+    ctx->pDriverData = NULL;
+
+    pthread_mutex_lock(&concurrency_mutex);
+    instances--;
+    pthread_mutex_unlock(&concurrency_mutex);
+}
+
 __attribute__((visibility("default")))
 VAStatus __vaDriverInit_1_0(VADriverContextP ctx) {
     LOG("Initialising NVIDIA VA-API Driver: %X", ctx->display_type);
@@ -2088,6 +3743,11 @@ VAStatus __vaDriverInit_1_0(VADriverContextP ctx) {
                  (((ctx->display_type & VA_DISPLAY_MAJOR_MASK) == VA_DISPLAY_DRM) ||
                   ((ctx->display_type & VA_DISPLAY_MAJOR_MASK) == VA_DISPLAY_WAYLAND));
 
+    //check to make sure we initialised the CUDA functions correctly
+    if (cu == NULL || cv == NULL) {
+        return VA_STATUS_ERROR_OPERATION_FAILED;
+    }
+
     pthread_mutex_lock(&concurrency_mutex);
     LOG("Now have %d (%d max) instances", instances, max_instances);
     if (max_instances > 0 && instances >= max_instances) {
@@ -2097,11 +3757,6 @@ VAStatus __vaDriverInit_1_0(VADriverContextP ctx) {
     instances++;
     pthread_mutex_unlock(&concurrency_mutex);
 
-    //check to make sure we initialised the CUDA functions correctly
-    if (cu == NULL || cv == NULL) {
-        return VA_STATUS_ERROR_OPERATION_FAILED;
-    }
-
     NVDriver *drv = (NVDriver*) calloc(1, sizeof(NVDriver));
     ctx->pDriverData = drv;
 
@@ -2121,7 +3776,7 @@ VAStatus __vaDriverInit_1_0(VADriverContextP ctx) {
 
     ctx->max_profiles = MAX_PROFILES;
     ctx->max_entrypoints = 1;
-    ctx->max_attributes = 1;
+    ctx->max_attributes = 2;
     ctx->max_display_attributes = 1;
     ctx->max_image_formats = ARRAY_SIZE(formatsInfo) - 1;
     ctx->max_subpic_formats = 1;
@@ -2137,16 +3792,29 @@ VAStatus __vaDriverInit_1_0(VADriverContextP ctx) {
     pthread_mutexattr_settype(&attrib, PTHREAD_MUTEX_RECURSIVE);
     pthread_mutex_init(&drv->objectCreationMutex, &attrib);
     pthread_mutex_init(&drv->imagesMutex, &attrib);
-    pthread_mutex_init(&drv->exportMutex, NULL);
-
-    if (!drv->backend->initExporter(drv)) {
-        free(drv);
-        return VA_STATUS_ERROR_OPERATION_FAILED;
-    }
-
-    if (CHECK_CUDA_RESULT(cu->cuCtxCreate(&drv->cudaContext, CU_CTX_SCHED_BLOCKING_SYNC, drv->cudaGpuId))) {
-        drv->backend->releaseExporter(drv);
-        free(drv);
+    pthread_mutexattr_destroy(&attrib);
+    init_handle_table(&drv->objects);
+    initObjectSlabs(drv);
+    init_buffer_pool(&drv->bufferPool, BUFFER_POOL_MAX_CACHED_BYTES);
+    initResolvePool(drv);
+    pthread_mutex_init(&drv->gpuMutex, NULL);
+    pthread_mutex_init(&drv->capsMutex, NULL);
+    drv->numaNode = -1;
+
+    //if we can tell which GPU we'll end up on without touching it, and we've seen it before, the GPU is left alone until
+    //the application creates surfaces or a decoder
+    uint8_t uuid[CAPS_UUID_SIZE];
+    bool haveUuid = false;
+    if (gpu == -1 && drv->drmFd != -1) {
+        haveUuid = caps_cache_uuid_from_drm_fd(drv->drmFd, uuid);
+    }
+    if (!haveUuid && gpu <= 0) {
+        haveUuid = caps_cache_uuid_of_only_gpu(uuid);
+    }
+    if (haveUuid && loadCodecCaps(drv, uuid)) {
+        LOG("Deferring GPU initialisation");
+    } else if (!initGpu(drv)) {
+        abortDriverInit(ctx, drv);
         return VA_STATUS_ERROR_OPERATION_FAILED;
     }
 
@@ -2207,6 +3875,10 @@ VAStatus __vaDriverInit_1_0(VADriverContextP ctx) {
     VTABLE(ctx, CreateBuffer2);
     VTABLE(ctx, QueryProcessingRate);
     VTABLE(ctx, ExportSurfaceHandle);
+#if VA_CHECK_VERSION(1, 9, 0)
+    VTABLE(ctx, SyncSurface2);
+    VTABLE(ctx, SyncBuffer);
+#endif
 
     return VA_STATUS_SUCCESS;
 }
@@ -10,15 +10,49 @@
 
 #include <pthread.h>
 #include "list.h"
+#include "handle-table.h"
+#include "slab.h"
+#include "buffer-pool.h"
+#include "cuda-extra.h"
+#include "fast-copy.h"
+#include "spsc-queue.h"
+#include "numa.h"
+#include "caps-cache.h"
 #include "direct/nv-driver.h"
 
 #define SURFACE_QUEUE_SIZE 16
+#define SUBMIT_QUEUE_SIZE 4
+#define MAX_OUTPUT_SURFACES 8
 #define MAX_IMAGE_COUNT 64
+//upper bound on the picture indices a single decoder can hand out
+#define MAX_DECODE_SURFACES 64
+//decoders are created with at least this many, as the count can't change without losing the reference frames
+#define MIN_DECODE_SURFACES 8
+#define MAX_RESOLVE_THREADS 16
+//how many surfaces a resolve worker handles from one context before giving the others a turn
+#define RESOLVE_BATCH_SIZE 4
+
+//context priority classes, these are also the values accepted for VAConfigAttribContextPriority
+typedef enum {
+    NV_PRIORITY_LOW = 0,
+    NV_PRIORITY_NORMAL,
+    NV_PRIORITY_HIGH,
+    NV_PRIORITY_LEVELS
+} NVPriority;
 
 typedef struct {
     void        *buf;
     uint64_t    size;
     uint64_t    allocated;
+    //largest size seen since the last decay check
+    uint64_t    highWater;
+    uint32_t    resets;
+    //if set, try to allocate page-locked memory in this context so NVDEC can DMA straight from it
+    CUcontext   pinContext;
+    unsigned int pinFlags;
+    //NUMA node to prefer for page-locked memory, -1 for no preference
+    int         numaNode;
+    bool        pinned;
 } AppendableBuffer;
 
 typedef enum
@@ -27,7 +61,8 @@ typedef enum
     OBJECT_TYPE_CONTEXT,
     OBJECT_TYPE_SURFACE,
     OBJECT_TYPE_BUFFER,
-    OBJECT_TYPE_IMAGE
+    OBJECT_TYPE_IMAGE,
+    OBJECT_TYPE_MAX
 } ObjectType;
 
 typedef struct Object_t
@@ -44,6 +79,8 @@ typedef struct
     VABufferType    bufferType;
     void            *ptr;
     int             offset;
+    //set if ptr was allocated from this context's slice data arena rather than the buffer pool
+    struct _NVContext *arenaContext;
 } NVBuffer;
 
 struct _NVContext;
@@ -64,6 +101,17 @@ typedef struct
     int                     order_hint; //needed for AV1
     struct _BackingImage    *backingImage;
     int                     resolving;
+    //decoded, but not copied into the backing image yet as nothing has needed the contents
+    bool                    resolvePending;
+    //set once the surface has been exported, as the client can then read it without telling us
+    bool                    exported;
+    //set if the last picture decoded into this surface couldn't be submitted to NVDEC
+    bool                    decodeFailed;
+    VASurfaceDecodeMBErrors decodeErrors[2];
+    //recorded on the context's stream once the copy into the backing image has been queued
+    CUevent                 copyEvent;
+    //how many of the resolve pool's mappings still wait on copyEvent before they're released
+    int                     mappedFrames;
     pthread_mutex_t         mutex;
     pthread_cond_t          cond;
 } NVSurface;
@@ -87,6 +135,7 @@ typedef struct
     int         height;
     NVFormat    format;
     NVBuffer    *imageBuffer;
+    VABufferID  imageBufferId;
 } NVImage;
 
 typedef struct {
@@ -113,48 +162,133 @@ typedef struct _BackingImage {
 
 struct _NVDriver;
 
+typedef struct {
+    NVSurface   *surface;
+    CUdeviceptr deviceMemory;
+    //the copy out of the mapping has to finish before it can be unmapped
+    CUevent     copyEvent;
+} MappedFrame;
+
+typedef struct {
+    struct _NVDriver    *drv;
+    int                 idx;
+    pthread_t           thread;
+} ResolveWorker;
+
+//Driver wide pool of threads that map decoded frames and copy them into their backing images.
+//Each worker has a list of contexts with surfaces waiting per priority, a context is only ever on one list (or
+//being resolved by one worker) at a time, which keeps each context's surfaces in order. Workers always take
+//the highest priority context they can find, their own or stolen, before looking at the next priority down.
+typedef struct {
+    pthread_mutex_t     mutex;
+    pthread_cond_t      cond;
+    //signalled when a context is no longer scheduled, so it can be destroyed
+    pthread_cond_t      idleCondition;
+    ResolveWorker       workers[MAX_RESOLVE_THREADS];
+    int                 threadCount;
+    //how many workers the GPU's copy engines (or NVD_RESOLVE_THREADS) call for, 0 until the first context is attached
+    int                 baseThreadCount;
+    //attached contexts, the pool has at least this many workers unless NVD_RESOLVE_THREADS is set
+    int                 contexts;
+    bool                exiting;
+    struct _NVContext   *runHead[MAX_RESOLVE_THREADS][NV_PRIORITY_LEVELS];
+    struct _NVContext   *runTail[MAX_RESOLVE_THREADS][NV_PRIORITY_LEVELS];
+    uint32_t            nextHome;
+    uint32_t            steals;
+} ResolvePool;
+
 typedef struct {
     const char *name;
     bool (*initExporter)(struct _NVDriver *drv);
     void (*releaseExporter)(struct _NVDriver *drv);
-    bool (*exportCudaPtr)(struct _NVDriver *drv, CUdeviceptr ptr, NVSurface *surface, uint32_t pitch);
+    bool (*exportCudaPtr)(struct _NVDriver *drv, CUdeviceptr ptr, NVSurface *surface, uint32_t pitch, CUstream stream);
     void (*detachBackingImageFromSurface)(struct _NVDriver *drv, NVSurface *surface);
     bool (*realiseSurface)(struct _NVDriver *drv, NVSurface *surface);
     bool (*fillExportDescriptor)(struct _NVDriver *drv, NVSurface *surface, VADRMPRIMESurfaceDescriptor *desc);
     void (*destroyAllBackingImage)(struct _NVDriver *drv);
 } NVBackend;
 
+//exporter state that's shared by every driver instance in the process using the same GPU, the backend decides what
+//identifies a GPU, and sets the state up when the first instance attaches to it
+typedef struct _NVGpu
+{
+    struct _NVGpu           *next;
+    const NVBackend         *backend;
+    uintptr_t               key;
+    //protected by the shared GPU list mutex
+    uint32_t                refs;
+    //the backend's results from setting up the exporter, copied into each instance
+    int                     cudaGpuId;
+    bool                    supports16BitSurface;
+    bool                    supports444Surface;
+    //serialises access to the exporter from all instances on this GPU
+    pthread_mutex_t         exportMutex;
+    //fields for direct backend
+    NVDriverContext         driverContext;
+    //fields for egl backend
+    EGLDisplay              eglDisplay;
+    EGLStreamKHR            eglStream;
+    CUeglStreamConnection   cuStreamConnection;
+    int                     numFramesPresented;
+} NVGpu;
+
 typedef struct _NVDriver
 {
     CudaFunctions           *cu;
     CuvidFunctions          *cv;
     CUcontext               cudaContext;
-    Array/*<Object>*/       objects;
+    HandleTable/*<Object>*/ objects;
     pthread_mutex_t         objectCreationMutex;
-    VAGenericID             nextObjId;
+    //object header+payload allocators, one per ObjectType, protected by objectCreationMutex
+    Slab                    objectSlabs[OBJECT_TYPE_MAX];
+    //backing storage for VABuffers
+    BufferPool              bufferPool;
+    ResolvePool             resolvePool;
     bool                    useCorrectNV12Format;
     bool                    supports16BitSurface;
     bool                    supports444Surface;
     int                     cudaGpuId;
     int                     drmFd;
-    int                     surfaceCount;
-    pthread_mutex_t         exportMutex;
+    //the NUMA node the GPU is attached to (-1 if unknown), worker threads are kept on its CPUs
+    int                     numaNode;
+    bool                    hasNumaCpus;
+    cpu_set_t               numaCpus;
+    //the exporter and CUDA context are only set up once something needs the GPU, protected by gpuMutex
+    pthread_mutex_t         gpuMutex;
+    bool                    gpuInitialised;
+    bool                    gpuInitFailed;
+    //set if cudaContext is the GPU's primary context, which other instances may be using
+    bool                    sharedContext;
+    //what NVDEC supports on this GPU, filled in as it's queried (or loaded from the cache file)
+    CapsTable               caps;
+    pthread_mutex_t         capsMutex;
+    bool                    capsDirty;
+    //names the cache file after the GPU and driver version, empty if the cache can't be used
+    char                    capsKey[64];
     pthread_mutex_t         imagesMutex;
     Array/*<NVEGLImage>*/   images;
     const NVBackend         *backend;
-    //fields for direct backend
-    NVDriverContext         driverContext;
+    //exporter state, shared with other instances on the same GPU
+    NVGpu                   *gpu;
     //fields for egl backend
     EGLDeviceEXT            eglDevice;
-    EGLDisplay              eglDisplay;
     EGLContext              eglContext;
-    EGLStreamKHR            eglStream;
-    CUeglStreamConnection   cuStreamConnection;
-    int                     numFramesPresented;
 } NVDriver;
 
 struct _NVCodec;
 
+typedef struct
+{
+    CUVIDPICPARAMS      picParams;
+    NVSurface           *surface;
+    //the bitstream and offsets are swapped with the context's, so each job keeps its own allocation
+    AppendableBuffer    bitstreamBuffer;
+    AppendableBuffer    sliceOffsets;
+    //set if pBitstreamData points into the slice arena, which is kept alive until the job is submitted
+    bool                usesArena;
+    bool                deferResolve;
+} NVSubmitJob;
+
 typedef struct _NVContext
 {
     NVDriver            *drv;
@@ -163,22 +297,70 @@ typedef struct _NVContext
     int                 width;
     int                 height;
     CUvideodecoder      decoder;
+    //NVDEC takes this around its use of the CUDA context, it's ours to destroy after the decoder
+    CUvideoctxlock      vidLock;
+    //non-blocking stream used for post-processing and copying decoded frames, so contexts don't serialise on the null stream
+    CUstream            stream;
     NVSurface           *renderTarget;
     void                *lastSliceParams;
     unsigned int        lastSliceParamsCount;
     AppendableBuffer    bitstreamBuffer;
     AppendableBuffer    sliceOffsets;
+    //slice data buffers are allocated here so NVDEC can read them in place, size is the allocation cursor
+    AppendableBuffer    sliceArena;
+    pthread_mutex_t     sliceArenaMutex;
+    uint32_t            sliceArenaOutstanding;
+    uint64_t            sliceArenaWanted;
+    //the part of the arena that makes up the current picture's bitstream
+    uint64_t            bitstreamArenaBase;
+    uint64_t            bitstreamArenaSize;
+    //set once the current picture's bitstream has had to be copied into bitstreamBuffer
+    bool                bitstreamCopied;
+    //set if growing bitstreamBuffer or sliceOffsets failed, the picture is dropped rather than decoded
+    bool                bitstreamFailed;
     CUVIDPICPARAMS      pPicParams;
     const struct _NVCodec *codec;
-    int                 currentPictureId;
-    pthread_t           resolveThread;
-    pthread_mutex_t     resolveMutex;
-    pthread_cond_t      resolveCondition;
-    NVSurface*          surfaceQueue[SURFACE_QUEUE_SIZE];
-    int                 surfaceQueueReadIdx;
-    int                 surfaceQueueWriteIdx;
-    bool                exiting;
+    //what the decoder was created with
+    CUVIDDECODECREATEINFO decoderInfo;
+    //picture indices are recycled when surfaces are destroyed or move to another context, nvBeginPicture fails once
+    //they've all been handed out
+    pthread_mutex_t     pictureIdxMutex;
+    int                 nextPictureIdx;
+    int                 freePictureIdx[MAX_DECODE_SURFACES];
+    int                 freePictureIdxCount;
+    //the resolve pool worker this context is normally handed to
+    int                 homeWorker;
+    //protected by the pool mutex, as it picks the run list the context goes on
+    NVPriority          priority;
+    //set while the context is on a worker's run list or being resolved, protected by the pool mutex
+    bool                scheduled;
+    struct _NVContext   *runNext;
+    //frames the resolve pool currently has mapped for this context, only touched by the worker that owns it
+    MappedFrame         mapped[MAX_OUTPUT_SURFACES];
+    int                 mappedHead;
+    int                 mappedCount;
+    //decoded surfaces waiting to be resolved, pushed by nvEndPicture (or the submission thread) and popped by the resolve pool
+    SpscQueue/*<NVSurface>*/ surfaceQueue;
+    //deferred surfaces can be queued from any thread, so producers are serialised
+    pthread_mutex_t     surfaceQueueMutex;
+    //only resolve surfaces when something needs their contents
+    bool                lazyResolve;
+    //set by the codec if the current picture won't be displayed as is, e.g. VP9/AV1 frames with show_frame = 0, or the
+    //first field of a pair, which the second field will resolve along with it
+    bool                pictureHidden;
+    uint32_t            skippedResolves;
+    //how many frames the resolve pool can keep mapped at once
+    int                 numOutputSurfaces;
     pthread_mutex_t     surfaceCreationMutex;
+    //optional thread that calls cuvidDecodePicture so nvEndPicture can return straight away
+    bool                asyncSubmit;
+    pthread_t           submitThread;
+    pthread_mutex_t     submitMutex;
+    pthread_cond_t      submitCondition;
+    NVSubmitJob         submitQueue[SUBMIT_QUEUE_SIZE];
+    int                 submitQueueReadIdx;
+    int                 submitQueueCount;
+    bool                submitExiting;
 } NVContext;
 
 typedef struct
@@ -189,6 +371,8 @@ typedef struct
     cudaVideoChromaFormat   chromaFormat;
     int                     bitDepth;
     cudaVideoCodec          cudaCodec;
+    //-1 if the client didn't ask for a priority
+    int                     priority;
 } NVConfig;
 
 typedef void (*HandlerFunc)(NVContext*, NVBuffer* , CUVIDPICPARAMS*);
@@ -201,6 +385,11 @@ struct _NVCodec {
     HandlerFunc         handlers[VABufferTypeMax];
     int                 supportedProfileCount;
     const VAProfile     *supportedProfiles;
+    //allocate slice data buffers in the context's arena, leaving room for a header of this size in front
+    bool                sliceDataInArena;
+    uint32_t            sliceDataHeaderSize;
+    //the codec reads the slice data on the CPU (e.g. to parse frame headers), so it's copied in normally
+    bool                sliceDataParsed;
 };
 
 typedef struct _NVCodec NVCodec;
@@ -231,8 +420,16 @@ typedef struct
 
 extern const NVFormatInfo formatsInfo[];
 
-void appendBuffer(AppendableBuffer *ab, const void *buf, uint64_t size);
+void *reserveBuffer(AppendableBuffer *ab, uint64_t size);
+void commitBuffer(AppendableBuffer *ab, uint64_t size);
+bool appendBuffer(AppendableBuffer *ab, const void *buf, uint64_t size);
+void resetBuffer(AppendableBuffer *ab);
+uint32_t appendSliceData(NVContext *ctx, NVBuffer *buf, uint32_t offset, uint32_t size, const uint8_t *header, uint32_t headerSize);
 int pictureIdxFromSurfaceId(NVDriver *ctx, VASurfaceID surf);
+NVGpu *lockSharedGpu(const NVBackend *backend, uintptr_t key);
+void unlockSharedGpu(NVGpu *gpu, bool keep);
+bool releaseSharedGpu(NVGpu *gpu);
+void freeSharedGpu(NVGpu *gpu);
 NVSurface* nvSurfaceFromSurfaceId(NVDriver *drv, VASurfaceID surf);
 bool checkCudaErrors(CUresult err, const char *file, const char *function, const int line);
 void logger(const char *filename, const char *function, int line, const char *msg, ...);
@@ -15,6 +15,7 @@ static void copyVC1PicParam(NVContext *ctx, NVBuffer* buffer, CUVIDPICPARAMS *pi
     picParams->bottom_field_flag = field_mode && !(buf->picture_fields.bits.top_field_first ^ !buf->picture_fields.bits.is_first_field);
 
     picParams->second_field      = !buf->picture_fields.bits.is_first_field;
+    ctx->pictureHidden           = picParams->field_pic_flag && !picParams->second_field;
 
     if (interlaced) {
         picParams->intra_pic_flag    = buf->picture_fields.bits.picture_type == 0 || //Intra
@@ -77,9 +78,10 @@ static void copyVC1SliceData(NVContext *ctx, NVBuffer* buf, CUVIDPICPARAMS *picP
     for (int i = 0; i < ctx->lastSliceParamsCount; i++)
     {
         VASliceParameterBufferVC1 *sliceParams = &((VASliceParameterBufferVC1*) ctx->lastSliceParams)[i];
-        uint32_t offset = (uint32_t) ctx->bitstreamBuffer.size;
-        appendBuffer(&ctx->sliceOffsets, &offset, sizeof(offset));
-        appendBuffer(&ctx->bitstreamBuffer, PTROFF(buf->ptr, sliceParams->slice_data_offset), sliceParams->slice_data_size);
+        uint32_t offset = appendSliceData(ctx, buf, sliceParams->slice_data_offset, sliceParams->slice_data_size, NULL, 0);
+        if (!appendBuffer(&ctx->sliceOffsets, &offset, sizeof(offset))) {
+            ctx->bitstreamFailed = true;
+        }
         picParams->nBitstreamDataLen += sliceParams->slice_data_size;
     }
 }
@@ -113,4 +115,5 @@ const DECLARE_CODEC(vc1Codec) = {
     },
     .supportedProfileCount = ARRAY_SIZE(vc1SupportedProfiles),
     .supportedProfiles = vc1SupportedProfiles,
+    .sliceDataInArena = true,
 };
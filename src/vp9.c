@@ -24,6 +24,7 @@ static void copyVP9PicParam(NVContext *ctx, NVBuffer* buffer, CUVIDPICPARAMS *pi
     picParams->CodecSpecific.vp9.frameContextIdx = buf->pic_fields.bits.frame_context_idx;
     picParams->CodecSpecific.vp9.frameType = buf->pic_fields.bits.frame_type;
     picParams->CodecSpecific.vp9.showFrame = buf->pic_fields.bits.show_frame;
+    ctx->pictureHidden = !buf->pic_fields.bits.show_frame;
     picParams->CodecSpecific.vp9.errorResilient = buf->pic_fields.bits.error_resilient_mode;
     picParams->CodecSpecific.vp9.frameParallelDecoding = buf->pic_fields.bits.frame_parallel_decoding_mode;
 
@@ -128,9 +129,10 @@ static void copyVP9SliceData(NVContext *ctx, NVBuffer* buf, CUVIDPICPARAMS *picP
     for (int i = 0; i < ctx->lastSliceParamsCount; i++)
     {
         VASliceParameterBufferVP9 *sliceParams = &((VASliceParameterBufferVP9*) ctx->lastSliceParams)[i];
-        uint32_t offset = (uint32_t) ctx->bitstreamBuffer.size;
-        appendBuffer(&ctx->sliceOffsets, &offset, sizeof(offset));
-        appendBuffer(&ctx->bitstreamBuffer, PTROFF(buf->ptr, sliceParams->slice_data_offset), sliceParams->slice_data_size);
+        uint32_t offset = appendSliceData(ctx, buf, sliceParams->slice_data_offset, sliceParams->slice_data_size, NULL, 0);
+        if (!appendBuffer(&ctx->sliceOffsets, &offset, sizeof(offset))) {
+            ctx->bitstreamFailed = true;
+        }
 
         //TODO this might not be the best place to call as we may not have a complete packet yet...
         parseExtraInfo(PTROFF(buf->ptr, sliceParams->slice_data_offset), sliceParams->slice_data_size, picParams);
@@ -166,4 +168,6 @@ const DECLARE_CODEC(vp9Codec) = {
     },
     .supportedProfileCount = ARRAY_SIZE(vp9SupportedProfiles),
     .supportedProfiles = vp9SupportedProfiles,
+    .sliceDataInArena = true,
+    .sliceDataParsed = true,
 };
@@ -0,0 +1,117 @@
+#define _GNU_SOURCE
+
+//pushContext and popContext are private to the driver, so they're built straight from the driver's source with the CUDA
+//context calls swapped for mocks that take a fixed amount of time
+#include "vabackend.c"
+#include "bench.h"
+
+#define ITERATIONS      200000
+//roughly what a context push or pop costs in the real driver, which takes a lock and validates the context
+#define CALL_NS         150
+//the decode path pushes the context once per VA-API call, then again in the helpers it calls
+#define NESTED_PUSHES   3
+
+static uint64_t calls;
+static int mockDepth;
+static CUcontext mockCurrent;
+
+static void spin(uint64_t ns) {
+    uint64_t end = bench_now_ns() + ns;
+    while (bench_now_ns() < end) {
+    }
+}
+
+static CUresult mockCtxPushCurrent(CUcontext context) {
+    calls++;
+    spin(CALL_NS);
+    mockDepth++;
+    mockCurrent = context;
+    return CUDA_SUCCESS;
+}
+
+static CUresult mockCtxPopCurrent(CUcontext *context) {
+    calls++;
+    spin(CALL_NS);
+    mockDepth--;
+    return CUDA_SUCCESS;
+}
+
+//the current context is thread local in the real driver, so looking it up is cheap
+static CUresult mockCtxGetCurrent(CUcontext *context) {
+    *context = mockCurrent;
+    return CUDA_SUCCESS;
+}
+
+static CUresult mockCtxSetCurrent(CUcontext context) {
+    calls++;
+    spin(CALL_NS);
+    mockCurrent = context;
+    return CUDA_SUCCESS;
+}
+
+static void runDirect(CUcontext context) {
+    for (int i = 0; i < ITERATIONS; i++) {
+        cu->cuCtxPushCurrent(context);
+        for (int j = 0; j < NESTED_PUSHES; j++) {
+            cu->cuCtxPushCurrent(context);
+            cu->cuCtxPopCurrent(NULL);
+        }
+        cu->cuCtxPopCurrent(NULL);
+    }
+}
+
+static void runTracked(CUcontext context) {
+    for (int i = 0; i < ITERATIONS; i++) {
+        pushContext(context);
+        for (int j = 0; j < NESTED_PUSHES; j++) {
+            pushContext(context);
+            popContext();
+        }
+        popContext();
+    }
+}
+
+static void report(const char *name, void (*run)(CUcontext)) {
+    calls = 0;
+    uint64_t start = bench_now_ns();
+    run((CUcontext) 1);
+    uint64_t elapsed = bench_now_ns() - start;
+    printf("%-14s %7.1f ns, %4.2f driver calls per VA-API call\n", name, (double) elapsed / ITERATIONS,
+           (double) calls / ITERATIONS);
+}
+
+int main(void) {
+    static CudaFunctions mockCu;
+    static CudaExtraFunctions mockCux;
+    mockCu.cuCtxPushCurrent = mockCtxPushCurrent;
+    mockCu.cuCtxPopCurrent = mockCtxPopCurrent;
+    mockCux.cuCtxGetCurrent = mockCtxGetCurrent;
+    mockCux.cuCtxSetCurrent = mockCtxSetCurrent;
+
+    //the driver's destructor frees whatever it loaded, so put that back afterwards
+    CudaFunctions *realCu = cu;
+    CudaExtraFunctions *realCux = cux;
+    cu = &mockCu;
+    cux = &mockCux;
+
+    printf("%d ns per push or pop, %d nested pushes\n", CALL_NS, NESTED_PUSHES);
+    report("direct", runDirect);
+    report("pushContext", runTracked);
+    bindContext = true;
+    report("bound", runTracked);
+    unbindContext((CUcontext) 1);
+    bindContext = false;
+
+    //nesting more contexts than are tracked falls back to the driver, and still has to unwind to where it started
+    for (int i = 1; i <= MAX_CONTEXT_DEPTH + 2; i++) {
+        pushContext((CUcontext) (uintptr_t) i);
+    }
+    for (int i = 1; i <= MAX_CONTEXT_DEPTH + 2; i++) {
+        popContext();
+    }
+    printf("context stack %s after overflowing\n", mockDepth == 0 ? "balanced" : "unbalanced");
+
+    cu = realCu;
+    cux = realCux;
+    return mockDepth == 0 ? 0 : 1;
+}
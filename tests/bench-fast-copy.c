@@ -0,0 +1,66 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench.h"
+#include "fast-copy.h"
+
+#define MIN_SIZE        (64 * 1024)
+#define MAX_SIZE        (32 * 1024 * 1024)
+//copy roughly this much at each size, so the small sizes aren't dominated by timer overhead
+#define BYTES_PER_SIZE  (1024ull * 1024 * 1024)
+
+typedef void (*CopyFunc)(void *dst, const void *src, size_t size);
+
+static void copyMemcpy(void *dst, const void *src, size_t size) {
+    memcpy(dst, src, size);
+}
+
+//cycles through enough buffers to fall out of the last level cache, as a new slice would
+static double bench(CopyFunc func, uint8_t *dst, const uint8_t *src, size_t size, size_t span) {
+    size_t count = span / size;
+    uint64_t iterations = BYTES_PER_SIZE / size;
+
+    uint64_t start = bench_now_ns();
+    for (uint64_t i = 0; i < iterations; i++) {
+        size_t offset = (i % count) * size;
+        func(dst + offset, src + offset, size);
+    }
+    uint64_t elapsed = bench_now_ns() - start;
+
+    return (double) (iterations * size) / elapsed;
+}
+
+int main(void) {
+    //a few of the largest copies, so even those cycle through more than the cache
+    size_t span = MAX_SIZE * 4;
+    uint8_t *src = malloc(span);
+    uint8_t *dst = malloc(span);
+    if (src == NULL || dst == NULL) {
+        return 1;
+    }
+    memset(src, 0x5a, span);
+    memset(dst, 0, span);
+
+    //start the workers and fault everything in before timing anything
+    fast_copy(dst, src, span);
+
+    printf("%10s %12s %15s\n", "size", "memcpy GB/s", "fast_copy GB/s");
+    for (size_t size = MIN_SIZE; size <= MAX_SIZE; size *= 2) {
+        double plain = bench(copyMemcpy, dst, src, size, span);
+        double fast = bench(fast_copy, dst, src, size, span);
+        printf("%9zuK %12.2f %15.2f\n", size / 1024, plain, fast);
+    }
+
+    if (memcmp(dst, src, span) != 0) {
+        printf("copy mismatch\n");
+        return 1;
+    }
+
+    release_fast_copy();
+    free(dst);
+    free(src);
+    return 0;
+}
@@ -0,0 +1,172 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "bench.h"
+#include "handle-table.h"
+
+#define LOOKUPS     (1u << 24)
+
+static volatile uintptr_t sink;
+
+//lookup cost shouldn't depend on how many objects are live
+static void benchLookup(uint32_t liveCount) {
+    HandleTable table;
+    init_handle_table(&table);
+
+    uint32_t *handles = malloc(liveCount * sizeof(uint32_t));
+    for (uint32_t i = 0; i < liveCount; i++) {
+        handles[i] = add_handle(&table, (void*) (uintptr_t) (i + 1));
+    }
+
+    //pick the handles up front so only the lookups are timed
+    uint32_t *order = malloc(LOOKUPS * sizeof(uint32_t));
+    uint32_t seed = 0x12345678;
+    for (uint32_t i = 0; i < LOOKUPS; i++) {
+        order[i] = handles[bench_rand(&seed) % liveCount];
+    }
+
+    uintptr_t sum = 0;
+    uint64_t start = bench_now_ns();
+    for (uint32_t i = 0; i < LOOKUPS; i++) {
+        sum += (uintptr_t) get_handle(&table, order[i]);
+    }
+    uint64_t elapsed = bench_now_ns() - start;
+    sink = sum;
+
+    printf("lookup   %6u live: %6.2f ns/op\n", liveCount, (double) elapsed / LOOKUPS);
+
+    free(order);
+    free(handles);
+    free_handle_table(&table);
+}
+
+//a delete followed by a create, the way short lived buffers churn through the table
+static void benchChurn(uint32_t liveCount) {
+    HandleTable table;
+    init_handle_table(&table);
+
+    uint32_t *handles = malloc(liveCount * sizeof(uint32_t));
+    for (uint32_t i = 0; i < liveCount; i++) {
+        handles[i] = add_handle(&table, (void*) (uintptr_t) (i + 1));
+    }
+
+    uint32_t seed = 0x87654321;
+    uint64_t start = bench_now_ns();
+    for (uint32_t i = 0; i < LOOKUPS / 4; i++) {
+        uint32_t idx = bench_rand(&seed) % liveCount;
+        remove_handle(&table, handles[idx]);
+        handles[idx] = add_handle(&table, (void*) (uintptr_t) (idx + 1));
+    }
+    uint64_t elapsed = bench_now_ns() - start;
+
+    printf("churn    %6u live: %6.2f ns/op\n", liveCount, (double) elapsed / (LOOKUPS / 4));
+
+    free(handles);
+    free_handle_table(&table);
+}
+
+#define CONCURRENT_LIVE         1000
+#define CONCURRENT_LOOKUPS      (1u << 22)
+
+typedef struct {
+    HandleTable     *table;
+    pthread_mutex_t *mutex;
+    const uint32_t  *handles;
+    uint32_t        seed;
+    bool            locked;
+} Reader;
+
+static void *readerThread(void *param) {
+    Reader *reader = (Reader*) param;
+    uintptr_t sum = 0;
+    for (uint32_t i = 0; i < CONCURRENT_LOOKUPS; i++) {
+        uint32_t handle = reader->handles[bench_rand(&reader->seed) % CONCURRENT_LIVE];
+        if (reader->locked) {
+            pthread_mutex_lock(reader->mutex);
+            sum += (uintptr_t) get_handle(reader->table, handle);
+            pthread_mutex_unlock(reader->mutex);
+        } else {
+            sum += (uintptr_t) get_handle(reader->table, handle);
+        }
+    }
+    sink = sum;
+    return NULL;
+}
+
+typedef struct {
+    HandleTable     *table;
+    pthread_mutex_t *mutex;
+    volatile bool   exiting;
+} Writer;
+
+//keeps creating and destroying objects alongside the readers, writers always take the lock
+static void *writerThread(void *param) {
+    Writer *writer = (Writer*) param;
+    while (!writer->exiting) {
+        pthread_mutex_lock(writer->mutex);
+        uint32_t handle = add_handle(writer->table, (void*) 1);
+        pthread_mutex_unlock(writer->mutex);
+        pthread_mutex_lock(writer->mutex);
+        remove_handle(writer->table, handle);
+        pthread_mutex_unlock(writer->mutex);
+    }
+    return NULL;
+}
+
+//lookups from several threads at once, with every lookup taking the table lock (the old behaviour) and without
+static void benchConcurrent(int threadCount, bool locked) {
+    HandleTable table;
+    pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+    init_handle_table(&table);
+
+    uint32_t handles[CONCURRENT_LIVE];
+    for (uint32_t i = 0; i < CONCURRENT_LIVE; i++) {
+        handles[i] = add_handle(&table, (void*) (uintptr_t) (i + 1));
+    }
+
+    Writer writer = { .table = &table, .mutex = &mutex, .exiting = false };
+    pthread_t writerId;
+    pthread_create(&writerId, NULL, writerThread, &writer);
+
+    Reader readers[threadCount];
+    pthread_t readerIds[threadCount];
+    uint64_t start = bench_now_ns();
+    for (int i = 0; i < threadCount; i++) {
+        readers[i] = (Reader) { .table = &table, .mutex = &mutex, .handles = handles, .seed = 0x9e3779b9u + i, .locked = locked };
+        pthread_create(&readerIds[i], NULL, readerThread, &readers[i]);
+    }
+    for (int i = 0; i < threadCount; i++) {
+        pthread_join(readerIds[i], NULL);
+    }
+    uint64_t elapsed = bench_now_ns() - start;
+
+    writer.exiting = true;
+    pthread_join(writerId, NULL);
+
+    double total = (double) CONCURRENT_LOOKUPS * threadCount;
+    printf("%s %2d threads: %8.1f M lookups/s\n", locked ? "locked   " : "lock free", threadCount, total * 1000.0 / elapsed);
+
+    free_handle_table(&table);
+}
+
+int main(void) {
+    static const uint32_t counts[] = { 10, 100, 1000, 10000 };
+    for (size_t i = 0; i < sizeof(counts) / sizeof(counts[0]); i++) {
+        benchLookup(counts[i]);
+    }
+    for (size_t i = 0; i < sizeof(counts) / sizeof(counts[0]); i++) {
+        benchChurn(counts[i]);
+    }
+
+    int cpus = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    for (int threads = 1; threads <= 8 && threads <= cpus * 2; threads *= 2) {
+        benchConcurrent(threads, true);
+        benchConcurrent(threads, false);
+    }
+    return 0;
+}
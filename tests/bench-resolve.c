@@ -0,0 +1,125 @@
+#define _GNU_SOURCE
+
+//the resolve stage is private to the driver, so it's built straight from the driver's source with CUDA and NVDEC
+//swapped for mocks that take a fixed amount of time
+#include "vabackend.c"
+#include "bench.h"
+
+#define FRAMES          240
+#define SURFACES        16
+//cuvidMapVideoFrame blocks while the video engine post-processes the frame
+#define MAP_NS          1000000
+//the copy into the backing image runs on the copy engine, one at a time in submission order
+#define COPY_NS         1000000
+
+struct CUevent_st {
+    uint64_t doneAt;
+};
+
+static uint64_t copyEngineFreeAt;
+
+static void sleepUntil(uint64_t ns) {
+    struct timespec ts = { .tv_sec = ns / 1000000000ull, .tv_nsec = ns % 1000000000ull };
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) != 0) {
+    }
+}
+
+static CUresult mockMapVideoFrame(CUvideodecoder decoder, int idx, CUdeviceptr *ptr, unsigned int *pitch, CUVIDPROCPARAMS *params) {
+    sleepUntil(bench_now_ns() + MAP_NS);
+    *ptr = (CUdeviceptr) (idx + 1);
+    *pitch = 4096;
+    return CUDA_SUCCESS;
+}
+
+static CUresult mockUnmapVideoFrame(CUvideodecoder decoder, CUdeviceptr ptr) {
+    return CUDA_SUCCESS;
+}
+
+static CUresult mockEventRecord(CUevent event, CUstream stream) {
+    event->doneAt = copyEngineFreeAt;
+    return CUDA_SUCCESS;
+}
+
+static CUresult mockEventSynchronize(CUevent event) {
+    sleepUntil(event->doneAt);
+    return CUDA_SUCCESS;
+}
+
+static CUresult mockStreamSynchronize(CUstream stream) {
+    sleepUntil(copyEngineFreeAt);
+    return CUDA_SUCCESS;
+}
+
+static bool mockExportCudaPtr(NVDriver *drv, CUdeviceptr ptr, NVSurface *surface, uint32_t pitch, CUstream stream) {
+    uint64_t now = bench_now_ns();
+    copyEngineFreeAt = (copyEngineFreeAt > now ? copyEngineFreeAt : now) + COPY_NS;
+    return true;
+}
+
+static const NVBackend mockBackend = {
+    .name = "mock",
+    .exportCudaPtr = mockExportCudaPtr,
+};
+
+static double benchResolve(int outputSurfaces) {
+    static NVDriver drv;
+    static NVContext ctx;
+    static NVSurface surfaces[SURFACES];
+    static struct CUevent_st events[SURFACES];
+
+    memset(&drv, 0, sizeof(drv));
+    memset(&ctx, 0, sizeof(ctx));
+    drv.backend = &mockBackend;
+    ctx.drv = &drv;
+    ctx.decoder = (CUvideodecoder) 1;
+    ctx.numOutputSurfaces = outputSurfaces;
+    for (int i = 0; i < SURFACES; i++) {
+        memset(&surfaces[i], 0, sizeof(NVSurface));
+        pthread_mutex_init(&surfaces[i].mutex, NULL);
+        pthread_cond_init(&surfaces[i].cond, NULL);
+        surfaces[i].pictureIdx = i;
+        surfaces[i].progressiveFrame = true;
+        surfaces[i].copyEvent = &events[i];
+    }
+    copyEngineFreeAt = 0;
+
+    uint64_t start = bench_now_ns();
+    for (int i = 0; i < FRAMES; i++) {
+        surfaces[i % SURFACES].resolving = 1;
+        resolveSurface(&ctx, &surfaces[i % SURFACES]);
+    }
+    unmapAllFrames(&ctx);
+    uint64_t elapsed = bench_now_ns() - start;
+
+    for (int i = 0; i < SURFACES; i++) {
+        pthread_mutex_destroy(&surfaces[i].mutex);
+        pthread_cond_destroy(&surfaces[i].cond);
+    }
+
+    return FRAMES * 1e9 / elapsed;
+}
+
+int main(void) {
+    static CudaFunctions mockCu;
+    static CuvidFunctions mockCv;
+    mockCu.cuEventRecord = mockEventRecord;
+    mockCu.cuEventSynchronize = mockEventSynchronize;
+    mockCu.cuStreamSynchronize = mockStreamSynchronize;
+    mockCv.cuvidMapVideoFrame = mockMapVideoFrame;
+    mockCv.cuvidUnmapVideoFrame = mockUnmapVideoFrame;
+
+    //the driver's destructor frees whatever it loaded, so put that back afterwards
+    CudaFunctions *realCu = cu;
+    CuvidFunctions *realCv = cv;
+    cu = &mockCu;
+    cv = &mockCv;
+
+    printf("map %d us, copy %d us per frame\n", MAP_NS / 1000, COPY_NS / 1000);
+    for (int outputSurfaces = 1; outputSurfaces <= MAX_OUTPUT_SURFACES; outputSurfaces *= 2) {
+        printf("%d output surfaces: %7.1f frames/s\n", outputSurfaces, benchResolve(outputSurfaces));
+    }
+
+    cu = realCu;
+    cv = realCv;
+    return 0;
+}
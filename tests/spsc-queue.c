@@ -0,0 +1,57 @@
+//the checks have to run in release builds too
+#undef NDEBUG
+#include <assert.h>
+#include <stdio.h>
+
+#include "spsc-queue.h"
+
+//closing the queue has to stop pushes even when there's still room, while anything already queued can be popped
+static void testPushAfterClose(void) {
+    SpscQueue queue;
+    int a = 1, b = 2;
+    void *element = NULL;
+
+    bool ok = init_spsc_queue(&queue, 4);
+    assert(ok);
+    ok = spsc_queue_push(&queue, &a);
+    assert(ok);
+
+    spsc_queue_close(&queue);
+    ok = spsc_queue_push(&queue, &b);
+    assert(!ok);
+    assert(spsc_queue_size(&queue) == 1);
+
+    ok = spsc_queue_try_pop(&queue, &element);
+    assert(ok);
+    assert(element == &a);
+    ok = spsc_queue_try_pop(&queue, &element);
+    assert(!ok);
+
+    free_spsc_queue(&queue);
+}
+
+static void testPushAfterCloseWhenFull(void) {
+    SpscQueue queue;
+    int a = 1;
+
+    bool ok = init_spsc_queue(&queue, 2);
+    assert(ok);
+    ok = spsc_queue_push(&queue, &a);
+    assert(ok);
+    ok = spsc_queue_push(&queue, &a);
+    assert(ok);
+
+    spsc_queue_close(&queue);
+    ok = spsc_queue_push(&queue, &a);
+    assert(!ok);
+    assert(spsc_queue_size(&queue) == 2);
+
+    free_spsc_queue(&queue);
+}
+
+int main(void) {
+    testPushAfterClose();
+    testPushAfterCloseWhenFull();
+    printf("spsc-queue: ok\n");
+    return 0;
+}